@@ -7,6 +7,9 @@
 #include <linux/usb.h>
 #include <linux/mutex.h>
 
+#define CREATE_TRACE_POINTS
+#include "mk2_trace.h"
+
 #define AUTHOR		"Patryk Wlazłyń"
 #define DESCRIPTION	"Driver for novation mk2 launchpad";
 #define VERSION		"0.1";
@@ -221,12 +224,7 @@ static void stuff_buffer(char *buf, size_t stuffed_size, const char __user *user
 			break;
 	}
 
-	print_hex_dump(KERN_DEBUG, "mk2 write (raw): ", DUMP_PREFIX_ADDRESS,
-			16, 1, user_buffer, count, true);
-
-	print_hex_dump(KERN_DEBUG, "mk2 write: ", DUMP_PREFIX_ADDRESS,
-			16, 1, buf, stuffed_size, true);
-
+	trace_mk2_write_stuffed(count, buf, stuffed_size);
 }
 
 static ssize_t mk2_write(struct file *filp, const char __user *user_buffer, size_t count, loff_t *ppos)
@@ -0,0 +1,39 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mk2
+
+#if !defined(_MK2_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MK2_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Sysex stream as sent to the device, after byte stuffing. */
+TRACE_EVENT(mk2_write_stuffed,
+
+	TP_PROTO(size_t count, const char *buf, size_t stuffed_size),
+
+	TP_ARGS(count, buf, stuffed_size),
+
+	TP_STRUCT__entry(
+		__field(size_t,			count)
+		__field(size_t,			stuffed_size)
+		__dynamic_array(unsigned char,	data, stuffed_size)
+	),
+
+	TP_fast_assign(
+		__entry->count		= count;
+		__entry->stuffed_size	= stuffed_size;
+		memcpy(__get_dynamic_array(data), buf, stuffed_size);
+	),
+
+	TP_printk("count=%zu stuffed_size=%zu data=%s",
+		  __entry->count, __entry->stuffed_size,
+		  __print_hex(__get_dynamic_array(data), __entry->stuffed_size))
+);
+
+#endif /* _MK2_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mk2_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,118 @@
+/*
+ * Times pread()/pwrite() on a scull device at offset 0 and at large
+ * offsets, sequentially and at random, to check that the cost of an
+ * access doesn't depend on where it lands.
+ *
+ * usage: bench_offset [device] [fill MB] [block bytes] [iterations]
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns the average ns per call, offsets chosen by pick(). */
+static double run(int fd, char *buf, size_t bs, long iters, int write,
+		off_t (*pick)(off_t, long), off_t base)
+{
+	double start = now_ns();
+	ssize_t ret;
+	long i;
+
+	for (i = 0; i < iters; i++) {
+		off_t off = pick(base, i);
+
+		if (write)
+			ret = pwrite(fd, buf, bs, off);
+		else
+			ret = pread(fd, buf, bs, off);
+		if (ret != (ssize_t) bs) {
+			perror(write ? "pwrite" : "pread");
+			exit(1);
+		}
+	}
+
+	return (now_ns() - start) / iters;
+}
+
+static off_t fill, bsize;
+
+static off_t pick_fixed(off_t base, long i)
+{
+	return base;
+}
+
+static off_t pick_seq(off_t base, long i)
+{
+	return base + (i * bsize) % (fill - base - bsize + 1) / bsize * bsize;
+}
+
+static off_t pick_random(off_t base, long i)
+{
+	return ((off_t) random() * bsize) % (fill - bsize + 1) / bsize * bsize;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/scull0";
+	long mb = argc > 2 ? atol(argv[2]) : 256;
+	long iters = argc > 4 ? atol(argv[4]) : 100000;
+	char *buf;
+	off_t off;
+	int fd, w;
+
+	bsize = argc > 3 ? atol(argv[3]) : 4096;
+	fill = (off_t) mb << 20;
+
+	if (mb <= 0 || bsize <= 0 || iters <= 0 || fill < 2 * bsize) {
+		fprintf(stderr, "usage: %s [device] [fill MB] [block bytes] [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(dev, O_RDWR | O_TRUNC);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+
+	buf = malloc(bsize);
+	if (!buf)
+		return 1;
+	memset(buf, 0x5a, bsize);
+
+	/* Fill the whole range, so every offset has data behind it */
+	for (off = 0; off < fill; off += bsize) {
+		if (pwrite(fd, buf, bsize, off) != bsize) {
+			perror("fill");
+			return 1;
+		}
+	}
+
+	printf("%s: %ld MB, %ld byte blocks, %ld iterations, ns per call\n",
+			dev, mb, (long) bsize, iters);
+	printf("%-8s %12s %12s %12s %12s\n", "", "offset 0", "offset end",
+			"seq at end", "random");
+
+	for (w = 0; w <= 1; w++) {
+		srandom(1);
+		printf("%-8s %12.0f %12.0f %12.0f %12.0f\n", w ? "pwrite" : "pread",
+				run(fd, buf, bsize, iters, w, pick_fixed, 0),
+				run(fd, buf, bsize, iters, w, pick_fixed, fill - bsize),
+				run(fd, buf, bsize, iters, w, pick_seq, fill / 2),
+				run(fd, buf, bsize, iters, w, pick_random, 0));
+	}
+
+	close(fd);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Measures read throughput of one scull device with 1 to N threads, each
+ * with its own file, reading the device over and over with pread(). With
+ * readers sharing the semaphore, throughput should grow with the number
+ * of threads up to the number of cores.
+ *
+ * usage: bench_read [device] [max threads] [fill MB] [block bytes] [seconds]
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct reader
+{
+	pthread_t thread;
+	int id;
+	int fd;
+	unsigned long long bytes;
+};
+
+static const char *dev;
+static off_t fill;
+static size_t bsize;
+static volatile int stop;
+static pthread_barrier_t barrier;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *reader_fn(void *arg)
+{
+	struct reader *r = arg;
+	char *buf = malloc(bsize);
+	off_t off;
+	ssize_t ret;
+
+	if (!buf)
+		exit(1);
+
+	pthread_barrier_wait(&barrier);
+
+	/* Each thread starts at a different place so they don't run in step */
+	off = (off_t) r->id * 997 % (fill / bsize) * bsize;
+
+	while (!stop) {
+		ret = pread(r->fd, buf, bsize, off);
+		if (ret <= 0) {
+			perror("pread");
+			exit(1);
+		}
+		r->bytes += ret;
+		off += ret;
+		if (off + (off_t) bsize > fill)
+			off = 0;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Returns MB/s read by nr threads over secs seconds. */
+static double run(int nr, int secs)
+{
+	struct reader *r = calloc(nr, sizeof(*r));
+	unsigned long long total = 0;
+	double start;
+	int i;
+
+	if (!r)
+		exit(1);
+
+	stop = 0;
+	pthread_barrier_init(&barrier, NULL, nr + 1);
+
+	for (i = 0; i < nr; i++) {
+		r[i].id = i;
+		r[i].fd = open(dev, O_RDONLY);
+		if (r[i].fd < 0) {
+			perror(dev);
+			exit(1);
+		}
+		pthread_create(&r[i].thread, NULL, reader_fn, &r[i]);
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = now_s();
+	sleep(secs);
+	stop = 1;
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(r[i].thread, NULL);
+		close(r[i].fd);
+		total += r[i].bytes;
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(r);
+
+	return total / (now_s() - start) / (1 << 20);
+}
+
+int main(int argc, char **argv)
+{
+	long max = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+	long mb = argc > 3 ? atol(argv[3]) : 64;
+	int secs = argc > 5 ? atoi(argv[5]) : 3;
+	double base = 0, mbs;
+	char *buf;
+	off_t off;
+	long nr;
+	int fd;
+
+	dev = argc > 1 ? argv[1] : "/dev/scull0";
+	bsize = argc > 4 ? atol(argv[4]) : 4096;
+	fill = (off_t) mb << 20;
+
+	if (max <= 0 || mb <= 0 || !bsize || secs <= 0 || fill < (off_t) bsize) {
+		fprintf(stderr, "usage: %s [device] [max threads] [fill MB] [block bytes] [seconds]\n",
+				argv[0]);
+		return 1;
+	}
+
+	fd = open(dev, O_WRONLY | O_TRUNC);
+	buf = malloc(bsize);
+	if (fd < 0 || !buf) {
+		perror(dev);
+		return 1;
+	}
+	memset(buf, 0x5a, bsize);
+
+	for (off = 0; off < fill; off += bsize) {
+		if (pwrite(fd, buf, bsize, off) != (ssize_t) bsize) {
+			perror("fill");
+			return 1;
+		}
+	}
+	close(fd);
+	free(buf);
+
+	printf("%s: %ld MB, %zu byte blocks, %d s per run\n", dev, mb, bsize, secs);
+	printf("%8s %12s %8s\n", "threads", "MB/s", "scaling");
+
+	for (nr = 1; nr <= max; nr++) {
+		mbs = run(nr, secs);
+		if (nr == 1)
+			base = mbs;
+		printf("%8ld %12.0f %8.2f\n", nr, mbs, mbs / base);
+	}
+
+	return 0;
+}
@@ -1,276 +1,2628 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/kdev_t.h>
-#include <linux/mutex.h>
+#include <linux/rwsem.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <asm-generic/bug.h>
 #include <linux/kernel.h>
 #include <linux/compiler.h>
+#include <linux/xarray.h>
+#include <linux/log2.h>
+#include <linux/capability.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/shrinker.h>
+#include <linux/atomic.h>
+#include <linux/err.h>
+#include <linux/lz4.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/rcupdate.h>
+#include <linux/pagemap.h>
+
+#include "scull.h"
+
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
+#define SCULL_QUANTUM PAGE_SIZE
+#define SCULL_QSET (PAGE_SIZE / sizeof(void *))
+
+#define SCULL_QUANTUM_MAX (PAGE_SIZE << 4)
+#define SCULL_QSET_MAX PAGE_SIZE
+
+#define SCULL_NR_DEVS 4
+#define SCULL_NR_SNAPS 4
+#define SCULL_NR_DEVS_MAX 256
+
+#define SCULL_POOL_MAX 65536
+#define SCULL_POOL_BATCH 16
+
+#define SCULL_TRIM_BATCH 64
+
+#define SCULL_ZCACHE 4
+
+//ssize_t (*read) (struct file *, char __user *, size_t, loff_t *);
+//ssize_t (*write) (struct file *, const char __user *, size_t, loff_t *);
+//int (*open) (struct inode *, struct file *);
+//int (*release) (struct inode *, struct file *);
+
+struct scull_qset
+{
+	void **data;
+	unsigned long atime;       /* jiffies of the last access, when compressing */
+	bool packed;               /* compressed since it was last written */
+};
+
+/*
+ * A compressed quantum. Slots holding one have the low bit of the pointer
+ * set, quanta from the slab and page allocators are at least 8 byte
+ * aligned so the bit is otherwise always clear.
+ */
+struct scull_zquant
+{
+	unsigned int len;
+	u8 data[];
+};
+
+#define SCULL_ZTAG 1UL
+
+/* Decompressed copy of a compressed quantum, keyed by its tagged slot value. */
+struct scull_zcache
+{
+	void *key;
+	void *buf;
+	size_t size;
+};
+
+/* Hot path counters, kept per cpu and summed when reported. */
+struct scull_stats
+{
+	u64 reads;
+	u64 read_bytes;
+	u64 writes;
+	u64 write_bytes;
+	u64 read_contended;        /* reader had to wait for the semaphore */
+	u64 write_contended;
+};
+
+struct scull_dev
+{
+	struct xarray *data;       /* Quantum sets indexed by item number */
+	size_t quantum;            /* the current quantum size */
+	size_t qset;               /* the current array size */
+	struct kmem_cache *quantum_cache; /* NULL for page backed quanta */
+	struct kmem_cache *qset_cache;
+	void **pool;               /* preallocated quanta */
+	int pool_nr;
+	spinlock_t pool_lock;
+	struct work_struct pool_work;
+	unsigned long size;        /* amount of data stored here */
+	unsigned int gen;          /* bumped when qsets are freed or renumbered */
+	unsigned long nr_qsets;    /* allocated qsets, under sem */
+	unsigned long nr_quanta;   /* allocated quanta, under sem */
+	struct scull_stats __percpu *stats;
+	struct scull_trim_stats trim_stats;
+	spinlock_t stats_lock;
+	bool cow;                  /* quanta may be shared with snapshots */
+	int nr_snaps;              /* live snapshots taken of it, under sem */
+	struct scull_dev *origin;  /* device a snapshot was taken of */
+	unsigned long cow_shared;  /* quanta shared by snapshots taken */
+	unsigned long cow_copied;  /* shared quanta copied on write */
+	atomic_t nr_wmaps;         /* writable shared mappings */
+	atomic_t nr_maps;          /* all mappings */
+	struct mutex map_lock;     /* new mappings against compression and cow */
+	bool snapshot;             /* read-only snapshot minor */
+	bool in_use;               /* snapshot slot holds a snapshot */
+	int nr_open;               /* openers of a snapshot slot */
+	u64 limit;                 /* max bytes of quanta, 0 for no limit */
+	bool cache;                /* quanta may be evicted under pressure */
+	unsigned long evicted;     /* quanta evicted by the shrinker */
+	int numa;                  /* SCULL_NUMA_LOCAL, SCULL_NUMA_INTERLEAVE or a node */
+	int numa_next;             /* next node to interleave on */
+	unsigned long *node_bytes; /* bytes of quanta referenced per node, under sem */
+	unsigned long zidle;       /* jiffies before a qset is compressed, 0 for never */
+	struct delayed_work zwork;
+	unsigned long zquanta;     /* compressed quanta, under sem */
+	unsigned long zbytes;      /* their compressed size, under sem */
+	struct scull_zcache zcache[SCULL_ZCACHE];
+	int zcache_next;
+	struct mutex zcache_lock;
+	u64 zdecomp;               /* decompressions, under stats_lock */
+	u64 zdecomp_ns;
+	u64 zdecomp_max_ns;
+	// unsigned int access_key;   /* used by sculluid and scullpriv */
+	struct rw_semaphore sem;   /* readers share, writers exclusive */
+	struct cdev cdev;          /* Char device structure */
+};
+
+/*
+ * Per open file state. Caches the last quantum set looked up, so a
+ * sequential stream only goes to the index when it crosses into the next
+ * item. The cache is only trusted while gen matches the device's.
+ */
+struct scull_file
+{
+	struct scull_dev *dev;
+	spinlock_t lock;           /* protects the cursor below */
+	struct scull_qset *dptr;
+	unsigned long item;
+	unsigned int gen;
+};
+
+struct scull_dev *scull_devices;
+struct proc_dir_entry *pentry;
+
+static dev_t scull_major = 0; /* if set to 0, it will be allocated dynamically */
+static dev_t scull_minor = 0;
+
+static int scull_nr_devs = SCULL_NR_DEVS;
+module_param(scull_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(scull_nr_devs, "Number of scull devices (minors) to create");
+
+static int scull_nr_snaps = SCULL_NR_SNAPS;
+module_param(scull_nr_snaps, int, S_IRUGO);
+MODULE_PARM_DESC(scull_nr_snaps, "Number of minors reserved for snapshots");
+
+/* Snapshot minors follow the scull_nr_devs regular ones. */
+static int scull_nr_total;
+static DEFINE_MUTEX(scull_snap_lock);
+
+static unsigned long scull_quantum = SCULL_QUANTUM;
+static unsigned long scull_qset = SCULL_QSET;
+module_param(scull_quantum, ulong, S_IRUGO);
+MODULE_PARM_DESC(scull_quantum, "Default quantum size in bytes");
+module_param(scull_qset, ulong, S_IRUGO);
+MODULE_PARM_DESC(scull_qset, "Default number of quanta per quantum set");
+
+static int scull_pool = 0;
+module_param(scull_pool, int, S_IRUGO);
+MODULE_PARM_DESC(scull_pool, "Number of quanta kept preallocated per device");
+
+static unsigned long scull_dev_limit = 0;
+module_param(scull_dev_limit, ulong, S_IRUGO);
+MODULE_PARM_DESC(scull_dev_limit, "Default per device limit in bytes of quanta, 0 for none");
+
+static unsigned long scull_mem_limit = 0;
+module_param(scull_mem_limit, ulong, S_IRUGO);
+MODULE_PARM_DESC(scull_mem_limit, "Limit in bytes of quanta over all devices, 0 for none");
+
+static int scull_numa = SCULL_NUMA_LOCAL;
+module_param(scull_numa, int, S_IRUGO);
+MODULE_PARM_DESC(scull_numa, "Default placement of quanta: -1 local, -2 interleave, or a node");
+
+/* Bytes of quanta allocated, pools included. */
+static atomic_long_t scull_mem = ATOMIC_LONG_INIT(0);
+
+/*
+ * Quanta up to a page can have any size, larger ones must be a power of
+ * two number of pages.
+ */
+static bool scull_quantum_valid(unsigned long quantum)
+{
+	if (quantum == 0 || quantum > SCULL_QUANTUM_MAX)
+		return false;
+
+	return quantum <= PAGE_SIZE || is_power_of_2(quantum);
+}
+
+static bool scull_qset_valid(unsigned long qset)
+{
+	return qset != 0 && qset <= SCULL_QSET_MAX;
+}
+
+/*
+ * Sub-page quanta and qset arrays come from kmem_caches, one per object
+ * size, shared by all devices. They are created on first use and
+ * destroyed on module exit.
+ */
+struct scull_cache
+{
+	struct list_head list;
+	size_t size;
+	struct kmem_cache *cache;
+};
+
+static LIST_HEAD(scull_caches);
+static DEFINE_MUTEX(scull_caches_lock);
+
+static struct kmem_cache *scull_cache_get(size_t size)
+{
+	struct scull_cache *sc;
+	char name[32];
+
+	mutex_lock(&scull_caches_lock);
+
+	list_for_each_entry(sc, &scull_caches, list)
+		if (sc->size == size)
+			goto out;
+
+	sc = kmalloc(sizeof(struct scull_cache), GFP_KERNEL);
+	if (!sc)
+		goto out;
+
+	snprintf(name, sizeof(name), "scull-%zu", size);
+	sc->cache = kmem_cache_create(name, size, 0, 0, NULL);
+	if (!sc->cache) {
+		kfree(sc);
+		sc = NULL;
+		goto out;
+	}
+
+	sc->size = size;
+	list_add(&sc->list, &scull_caches);
+
+out:
+	mutex_unlock(&scull_caches_lock);
+	return sc ? sc->cache : NULL;
+}
+
+static void scull_caches_destroy(void)
+{
+	struct scull_cache *sc, *tmp;
+
+	list_for_each_entry_safe(sc, tmp, &scull_caches, list) {
+		list_del(&sc->list);
+		kmem_cache_destroy(sc->cache);
+		kfree(sc);
+	}
+}
+
+/*
+ * Every quantum is charged against scull_mem_limit when allocated and
+ * uncharged when freed, and to the allocating task's memory cgroup.
+ */
+static bool scull_mem_charge(size_t bytes)
+{
+	unsigned long mem = atomic_long_add_return(bytes, &scull_mem);
+
+	if (scull_mem_limit && mem > scull_mem_limit) {
+		atomic_long_sub(bytes, &scull_mem);
+		return false;
+	}
+
+	return true;
+}
+
+static void scull_mem_uncharge(size_t bytes)
+{
+	atomic_long_sub(bytes, &scull_mem);
+}
+
+static bool scull_numa_valid(int numa)
+{
+	if (numa == SCULL_NUMA_LOCAL || numa == SCULL_NUMA_INTERLEAVE)
+		return true;
+
+	return numa >= 0 && numa < nr_node_ids && node_state(numa, N_MEMORY);
+}
+
+/*
+ * Node the next quantum of dev goes to. A fixed node is only preferred,
+ * allocations fall back to other nodes when it runs out of memory.
+ */
+static int scull_quantum_node(struct scull_dev *dev)
+{
+	int node = READ_ONCE(dev->numa);
+
+	if (node == SCULL_NUMA_LOCAL)
+		return NUMA_NO_NODE;
+
+	if (node == SCULL_NUMA_INTERLEAVE) {
+		node = READ_ONCE(dev->numa_next);
+		WRITE_ONCE(dev->numa_next, next_node_in(node, node_states[N_MEMORY]));
+	}
+
+	return node;
+}
+
+/* The index follows a fixed node, it is left local otherwise. */
+static int scull_index_node(struct scull_dev *dev)
+{
+	int node = READ_ONCE(dev->numa);
+
+	return node >= 0 ? node : NUMA_NO_NODE;
+}
+
+/*
+ * Quanta of a page or more come straight from the page allocator, as
+ * compound pages, so that they can be handed to userspace page by page.
+ */
+static void *scull_quantum_alloc(struct scull_dev *dev)
+{
+	int node = scull_quantum_node(dev);
+	struct page *page;
+	void *quant = NULL;
+
+	if (!scull_mem_charge(dev->quantum))
+		return ERR_PTR(-ENOSPC);
+
+	if (dev->quantum_cache) {
+		quant = kmem_cache_alloc_node(dev->quantum_cache,
+				GFP_KERNEL_ACCOUNT | __GFP_ZERO, node);
+	} else {
+		page = alloc_pages_node(node, GFP_KERNEL_ACCOUNT | __GFP_ZERO | __GFP_COMP,
+				get_order(dev->quantum));
+		if (page)
+			quant = page_address(page);
+	}
+
+	if (!quant) {
+		scull_mem_uncharge(dev->quantum);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	return quant;
+}
+
+/* Only local placement can use the slab bulk interface, which has no node. */
+static size_t scull_quantum_alloc_bulk(struct scull_dev *dev, size_t nr, void **quanta)
+{
+	size_t i;
+
+	if (dev->quantum_cache && READ_ONCE(dev->numa) == SCULL_NUMA_LOCAL) {
+		if (!scull_mem_charge(nr * dev->quantum))
+			return 0;
+
+		i = kmem_cache_alloc_bulk(dev->quantum_cache,
+				GFP_KERNEL_ACCOUNT | __GFP_ZERO, nr, quanta);
+		scull_mem_uncharge((nr - i) * dev->quantum);
+		return i;
+	}
+
+	for (i = 0; i < nr; i++) {
+		quanta[i] = scull_quantum_alloc(dev);
+		if (IS_ERR(quanta[i]))
+			break;
+	}
+
+	return i;
+}
+
+/* The array must not contain NULL entries. */
+static void scull_quanta_free(struct kmem_cache *cache, size_t quantum,
+		size_t nr, void **quanta)
+{
+	size_t i;
+
+	scull_mem_uncharge(nr * quantum);
+
+	if (cache) {
+		kmem_cache_free_bulk(cache, nr, quanta);
+		return;
+	}
+
+	for (i = 0; i < nr; i++)
+		__free_pages(virt_to_page(quanta[i]), get_order(quantum));
+}
+
+static void scull_quantum_free_bulk(struct scull_dev *dev, size_t nr, void **quanta)
+{
+	scull_quanta_free(dev->quantum_cache, dev->quantum, nr, quanta);
+}
+
+/*
+ * Quanta shared between a device and its snapshots are counted in
+ * scull_shared, keyed by address. A quantum without an entry has a single
+ * owner, so devices that were never snapshotted never look here.
+ */
+static DEFINE_XARRAY(scull_shared);
+static DEFINE_MUTEX(scull_shared_lock);
+
+#define SCULL_SHARED_KEY(quant) ((unsigned long) (quant) >> 3)
+
+static bool scull_share_test(void *quant)
+{
+	return xa_load(&scull_shared, SCULL_SHARED_KEY(quant)) != NULL;
+}
+
+static int scull_share_get(void *quant)
+{
+	unsigned long key = SCULL_SHARED_KEY(quant);
+	void *entry;
+	int ret;
+
+	mutex_lock(&scull_shared_lock);
+	entry = xa_load(&scull_shared, key);
+	entry = xa_mk_value(entry ? xa_to_value(entry) + 1 : 2);
+	ret = xa_err(xa_store(&scull_shared, key, entry, GFP_KERNEL));
+	mutex_unlock(&scull_shared_lock);
+
+	return ret;
+}
+
+/* Drops one owner, returns true if the caller was the last one. */
+static bool scull_share_put(void *quant)
+{
+	unsigned long key = SCULL_SHARED_KEY(quant);
+	unsigned long owners;
+	void *entry;
+
+	mutex_lock(&scull_shared_lock);
+	entry = xa_load(&scull_shared, key);
+	if (entry) {
+		owners = xa_to_value(entry) - 1;
+		if (owners == 1)
+			xa_erase(&scull_shared, key);
+		else
+			xa_store(&scull_shared, key, xa_mk_value(owners), GFP_KERNEL);
+	}
+	mutex_unlock(&scull_shared_lock);
+
+	return !entry;
+}
+
+static void scull_stats_add_ns(u64 *total, u64 *max, u64 ns)
+{
+	*total += ns;
+	if (ns > *max)
+		*max = ns;
+}
+
+static bool scull_zquant(void *quant)
+{
+	return (unsigned long) quant & SCULL_ZTAG;
+}
+
+static struct scull_zquant *scull_zptr(void *quant)
+{
+	return (struct scull_zquant *) ((unsigned long) quant & ~SCULL_ZTAG);
+}
+
+/*
+ * Counts a quantum entering (add) or leaving the index of dev against the
+ * node it sits on, called with the semaphore held for writing. A quantum
+ * shared with snapshots counts for each device referencing it.
+ */
+static void scull_node_account(struct scull_dev *dev, void *quant, bool add)
+{
+	struct page *page;
+	size_t len;
+
+	if (scull_zquant(quant)) {
+		page = virt_to_page(scull_zptr(quant));
+		len = scull_zptr(quant)->len;
+	} else {
+		page = virt_to_page(quant);
+		len = dev->quantum;
+	}
+
+	if (add)
+		dev->node_bytes[page_to_nid(page)] += len;
+	else
+		dev->node_bytes[page_to_nid(page)] -= len;
+}
+
+/* Frees a compressed quantum the caller was the last owner of. */
+static void scull_zfree(void *quant)
+{
+	struct scull_zquant *z = scull_zptr(quant);
+
+	scull_mem_uncharge(sizeof(struct scull_zquant) + z->len);
+	kfree(z);
+}
+
+static void scull_zcache_clear(struct scull_dev *dev, void *key)
+{
+	int i;
+
+	mutex_lock(&dev->zcache_lock);
+	for (i = 0; i < SCULL_ZCACHE; i++)
+		if (!key || dev->zcache[i].key == key)
+			dev->zcache[i].key = NULL;
+	mutex_unlock(&dev->zcache_lock);
+}
+
+/*
+ * Drops the device's reference to a compressed quantum, called with the
+ * semaphore held for writing. The cached copy goes first, as the address
+ * may be reused once the last owner frees it.
+ */
+static void scull_zrelease(struct scull_dev *dev, void *quant)
+{
+	scull_zcache_clear(dev, quant);
+	scull_node_account(dev, quant, false);
+
+	dev->zquanta--;
+	dev->zbytes -= scull_zptr(quant)->len;
+
+	if (!dev->cow || scull_share_put(quant))
+		scull_zfree(quant);
+}
+
+static void scull_quantum_release(struct scull_dev *dev, void *quant)
+{
+	if (scull_zquant(quant)) {
+		scull_zrelease(dev, quant);
+		return;
+	}
+
+	scull_node_account(dev, quant, false);
+	if (!dev->cow || scull_share_put(quant))
+		scull_quantum_free_bulk(dev, 1, &quant);
+}
+
+static int scull_zdecompress(struct scull_dev *dev, void *quant, void *buf)
+{
+	struct scull_zquant *z = scull_zptr(quant);
+	u64 start = ktime_get_ns(), ns;
+	int ret;
+
+	ret = LZ4_decompress_safe((const char *) z->data, buf, z->len, dev->quantum);
+	ns = ktime_get_ns() - start;
+
+	spin_lock(&dev->stats_lock);
+	dev->zdecomp++;
+	scull_stats_add_ns(&dev->zdecomp_ns, &dev->zdecomp_max_ns, ns);
+	spin_unlock(&dev->stats_lock);
+
+	return ret == dev->quantum ? 0 : -EIO;
+}
+
+/*
+ * Each device can keep up to scull_pool preallocated quanta, so a writer
+ * holding the semaphore only has to pop one off the pool. The pool is
+ * refilled in bulk from a work item, outside of the write path, so pooled
+ * quanta are not charged to the writer's memory cgroup.
+ */
+static void *scull_pool_get(struct scull_dev *dev)
+{
+	void *quant = NULL;
+	int left;
+
+	/* Snapshots have no pool, they only allocate to expand quanta */
+	if (!dev->pool)
+		return NULL;
+
+	spin_lock(&dev->pool_lock);
+	if (dev->pool_nr)
+		quant = dev->pool[--dev->pool_nr];
+	left = dev->pool_nr;
+	spin_unlock(&dev->pool_lock);
+
+	if (left < scull_pool / 2)
+		schedule_work(&dev->pool_work);
+
+	return quant;
+}
+
+static void scull_pool_refill(struct work_struct *work)
+{
+	struct scull_dev *dev = container_of(work, struct scull_dev, pool_work);
+	void *batch[SCULL_POOL_BATCH];
+	size_t want, got, i;
+
+	if (!dev->pool)
+		return;
+
+	/* Keeps the geometry, and so the quantum size, stable. */
+	down_read(&dev->sem);
+
+	for (;;) {
+		spin_lock(&dev->pool_lock);
+		want = min(scull_pool - dev->pool_nr, SCULL_POOL_BATCH);
+		spin_unlock(&dev->pool_lock);
+
+		if (!want)
+			break;
+
+		got = scull_quantum_alloc_bulk(dev, want, batch);
+		if (!got)
+			break;
+
+		spin_lock(&dev->pool_lock);
+		for (i = 0; i < got && dev->pool_nr < scull_pool; i++)
+			dev->pool[dev->pool_nr++] = batch[i];
+		spin_unlock(&dev->pool_lock);
+
+		if (i < got) {
+			scull_quantum_free_bulk(dev, got - i, batch + i);
+			break;
+		}
+	}
+
+	up_read(&dev->sem);
+}
+
+/* Called with the semaphore held for writing or the refill work stopped. */
+static void scull_pool_drain(struct scull_dev *dev)
+{
+	scull_quantum_free_bulk(dev, dev->pool_nr, dev->pool);
+	dev->pool_nr = 0;
+}
+
+/* Frees up to nr pooled quanta, called with the semaphore held. */
+static unsigned long scull_pool_shrink(struct scull_dev *dev, unsigned long nr)
+{
+	void *batch[SCULL_POOL_BATCH];
+	unsigned long freed = 0;
+	size_t n;
+
+	while (freed < nr) {
+		n = 0;
+		spin_lock(&dev->pool_lock);
+		while (n < SCULL_POOL_BATCH && freed + n < nr && dev->pool_nr)
+			batch[n++] = dev->pool[--dev->pool_nr];
+		spin_unlock(&dev->pool_lock);
+
+		if (!n)
+			break;
+
+		scull_quantum_free_bulk(dev, n, batch);
+		freed += n;
+	}
+
+	return freed;
+}
+
+/*
+ * Replaces the compressed quantum in *slot with a plain one, called with
+ * the semaphore held for writing.
+ */
+static void *scull_zexpand(struct scull_dev *dev, void **slot)
+{
+	void *quant;
+
+	quant = scull_pool_get(dev);
+	if (!quant)
+		quant = scull_quantum_alloc(dev);
+	if (IS_ERR(quant))
+		return quant;
+
+	if (scull_zdecompress(dev, *slot, quant)) {
+		scull_quantum_free_bulk(dev, 1, &quant);
+		return ERR_PTR(-EIO);
+	}
+
+	scull_zrelease(dev, *slot);
+	*slot = quant;
+	scull_node_account(dev, quant, true);
+	return quant;
+}
+
+/*
+ * Makes the quantum in *slot private to the device before it gets written:
+ * a compressed one is expanded and one shared with snapshots is copied.
+ * Called with the semaphore held for writing.
+ */
+static void *scull_quantum_own(struct scull_dev *dev, void **slot)
+{
+	void *quant = *slot, *copy;
+
+	/* Expanding also leaves the quantum private to the device */
+	if (scull_zquant(quant))
+		return scull_zexpand(dev, slot);
+
+	if (dev->cow && scull_share_test(quant)) {
+		copy = scull_pool_get(dev);
+		if (!copy)
+			copy = scull_quantum_alloc(dev);
+		if (IS_ERR(copy))
+			return copy;
+
+		memcpy(copy, quant, dev->quantum);
+		*slot = copy;
+		scull_node_account(dev, copy, true);
+		scull_quantum_release(dev, quant);
+		dev->cow_copied++;
+	}
+
+	return *slot;
+}
+
+/* Called with the semaphore held for writing, on an empty device. */
+static int scull_set_geometry(struct scull_dev *dev, size_t quantum, size_t qset)
+{
+	struct kmem_cache *quantum_cache = NULL, *qset_cache;
+
+	qset_cache = scull_cache_get(qset * sizeof(void *));
+	if (!qset_cache)
+		return -ENOMEM;
+
+	if (quantum < PAGE_SIZE) {
+		quantum_cache = scull_cache_get(quantum);
+		if (!quantum_cache)
+			return -ENOMEM;
+	}
+
+	scull_pool_drain(dev);
+
+	dev->quantum = quantum;
+	dev->qset = qset;
+	dev->gen++;
+	dev->quantum_cache = quantum_cache;
+	dev->qset_cache = qset_cache;
+
+	if (dev->pool)
+		schedule_work(&dev->pool_work);
+
+	return 0;
+}
+
+/*
+ * A detached index together with the geometry needed to free it. Trimming
+ * swaps the device's index for an empty one under the semaphore and leaves
+ * the freeing to scull_trim_wq, so the device is usable again at once.
+ */
+struct scull_trim_work
+{
+	struct work_struct work;
+	struct scull_dev *dev;
+	struct xarray *data;
+	size_t quantum, qset;
+	struct kmem_cache *quantum_cache, *qset_cache;
+	bool cow;
+};
+
+static struct workqueue_struct *scull_trim_wq;
+
+static void scull_free_data(struct scull_trim_work *tw)
+{
+	struct scull_qset *dptr;
+	unsigned long item, nr = 0;
+	void *quant;
+	int i, n;
+
+	/* Faults may still be walking the index, see scull_vma_fault() */
+	synchronize_rcu();
+
+	xa_for_each(tw->data, item, dptr) {
+		if (dptr->data) {
+			/*
+			 * Pack the quanta so they can be freed in one go,
+			 * leaving out those still owned by another device.
+			 * Compressed ones are freed on their own.
+			 */
+			for (i = 0, n = 0; i < tw->qset; i++) {
+				quant = dptr->data[i];
+				if (!quant || (tw->cow && !scull_share_put(quant)))
+					continue;
+				if (scull_zquant(quant))
+					scull_zfree(quant);
+				else
+					dptr->data[n++] = quant;
+			}
+			scull_quanta_free(tw->quantum_cache, tw->quantum, n, dptr->data);
+			kmem_cache_free(tw->qset_cache, dptr->data);
+		}
+		kfree(dptr);
+
+		if (++nr % SCULL_TRIM_BATCH == 0)
+			cond_resched();
+	}
+
+	xa_destroy(tw->data);
+	kfree(tw->data);
+}
+
+static void scull_trim_work_fn(struct work_struct *work)
+{
+	struct scull_trim_work *tw = container_of(work, struct scull_trim_work, work);
+	struct scull_dev *dev = tw->dev;
+	ktime_t start = ktime_get();
+
+	scull_free_data(tw);
+
+	spin_lock(&dev->stats_lock);
+	scull_stats_add_ns(&dev->trim_stats.free_ns, &dev->trim_stats.free_max_ns,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+	dev->trim_stats.pending--;
+	spin_unlock(&dev->stats_lock);
+
+	kfree(tw);
+}
+
+/*
+ * Empties the device. Everything that can fail is allocated before taking
+ * the semaphore, so the writer side is only held for the pointer swap.
+ */
+static int scull_trim(struct scull_dev *dev)
+{
+	struct scull_trim_work *tw;
+	struct xarray *empty;
+	unsigned long nr_quanta = 0;
+	ktime_t start;
+	u64 ns;
+	bool queued = false;
+
+	tw = kmalloc(sizeof(struct scull_trim_work), GFP_KERNEL);
+	empty = kmalloc(sizeof(struct xarray), GFP_KERNEL);
+	if (!tw || !empty) {
+		kfree(tw);
+		kfree(empty);
+		return -ENOMEM;
+	}
+	xa_init(empty);
+
+	start = ktime_get();
+
+	if (down_write_killable(&dev->sem)) {
+		kfree(tw);
+		kfree(empty);
+		return -ERESTARTSYS;
+	}
+
+	if (!xa_empty(dev->data)) {
+		INIT_WORK(&tw->work, scull_trim_work_fn);
+		tw->dev = dev;
+		tw->data = dev->data;
+		tw->quantum = dev->quantum;
+		tw->qset = dev->qset;
+		tw->quantum_cache = dev->quantum_cache;
+		tw->qset_cache = dev->qset_cache;
+		tw->cow = dev->cow;
+
+		smp_store_release(&dev->data, empty);
+		dev->gen++;
+		nr_quanta = dev->nr_quanta;
+		dev->nr_qsets = 0;
+		dev->nr_quanta = 0;
+		memset(dev->node_bytes, 0, nr_node_ids * sizeof(unsigned long));
+		dev->zquanta = 0;
+		dev->zbytes = 0;
+		queued = true;
+	}
+	scull_zcache_clear(dev, NULL);
+	WRITE_ONCE(dev->size, 0);
+	dev->cow = false;
+
+	up_write(&dev->sem);
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	trace_scull_trim(MINOR(dev->cdev.dev), nr_quanta, ns);
+
+	spin_lock(&dev->stats_lock);
+	dev->trim_stats.trims++;
+	scull_stats_add_ns(&dev->trim_stats.detach_ns, &dev->trim_stats.detach_max_ns, ns);
+	if (queued)
+		dev->trim_stats.pending++;
+	spin_unlock(&dev->stats_lock);
+
+	if (queued) {
+		queue_work(scull_trim_wq, &tw->work);
+	} else {
+		kfree(tw);
+		kfree(empty);
+	}
+
+	return 0;
+}
+
+/*
+ * Devices with compression on have the quanta of qsets left alone for
+ * zidle compressed with LZ4, by a delayed work that runs once per idle
+ * period. Quanta that don't shrink by a quarter are kept as they are.
+ * Devices sharing quanta with a snapshot or mapped are skipped, the old
+ * quanta would stay referenced and nothing would be saved.
+ */
+static bool scull_zcold(struct scull_qset *dptr, unsigned long idle)
+{
+	return dptr->data && !dptr->packed && time_after(jiffies, dptr->atime + idle);
+}
+
+/* Called with the semaphore held for writing. */
+static int scull_zpack(struct scull_dev *dev, struct scull_qset *dptr,
+		void *dst, void *wrkmem)
+{
+	int bound = LZ4_compressBound(dev->quantum);
+	struct scull_zquant *z;
+	size_t s_pos;
+	void *quant;
+	int len;
+
+	for (s_pos = 0; s_pos < dev->qset; s_pos++) {
+		quant = dptr->data[s_pos];
+		if (!quant || scull_zquant(quant))
+			continue;
+
+		len = LZ4_compress_default(quant, dst, dev->quantum, bound, wrkmem);
+		if (len <= 0 || len > dev->quantum - dev->quantum / 4)
+			continue;
+
+		if (!scull_mem_charge(sizeof(struct scull_zquant) + len))
+			return -ENOSPC;
+
+		z = kmalloc_node(sizeof(struct scull_zquant) + len, GFP_KERNEL_ACCOUNT,
+				scull_quantum_node(dev));
+		if (!z) {
+			scull_mem_uncharge(sizeof(struct scull_zquant) + len);
+			return -ENOMEM;
+		}
+
+		z->len = len;
+		memcpy(z->data, dst, len);
+		dptr->data[s_pos] = (void *) ((unsigned long) z | SCULL_ZTAG);
+		scull_node_account(dev, quant, false);
+		scull_node_account(dev, dptr->data[s_pos], true);
+		scull_quantum_free_bulk(dev, 1, &quant);
+		dev->zquanta++;
+		dev->zbytes += len;
+	}
+
+	dptr->packed = true;
+	return 0;
+}
+
+static void scull_zwork_fn(struct work_struct *work)
+{
+	struct scull_dev *dev = container_of(to_delayed_work(work), struct scull_dev, zwork);
+	unsigned long idle = READ_ONCE(dev->zidle), item = 0;
+	struct scull_qset *dptr;
+	void *wrkmem, *dst;
+	bool found;
+	int ret = 0;
+
+	if (!idle)
+		return;
+
+	wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+	dst = kvmalloc(LZ4_COMPRESSBOUND(SCULL_QUANTUM_MAX), GFP_KERNEL);
+	if (!wrkmem || !dst)
+		goto out;
+
+	while (!ret) {
+		/* Look for the next cold qset without holding off readers */
+		found = false;
+		down_read(&dev->sem);
+		while ((dptr = xa_find(dev->data, &item, ULONG_MAX, XA_PRESENT))) {
+			found = scull_zcold(dptr, idle);
+			if (found || item == ULONG_MAX)
+				break;
+			item++;
+		}
+		up_read(&dev->sem);
+
+		if (!found)
+			break;
+
+		down_write(&dev->sem);
+		mutex_lock(&dev->map_lock);
+		if (dev->cow || atomic_read(&dev->nr_maps)) {
+			mutex_unlock(&dev->map_lock);
+			up_write(&dev->sem);
+			break;
+		}
+		dptr = xa_load(dev->data, item);
+		if (dptr && scull_zcold(dptr, idle))
+			ret = scull_zpack(dev, dptr, dst, wrkmem);
+		mutex_unlock(&dev->map_lock);
+		up_write(&dev->sem);
+
+		if (item == ULONG_MAX)
+			break;
+		item++;
+		cond_resched();
+	}
+
+out:
+	kvfree(wrkmem);
+	kvfree(dst);
+
+	idle = READ_ONCE(dev->zidle);
+	if (idle)
+		queue_delayed_work(system_unbound_wq, &dev->zwork, idle);
+}
+
+/*
+ * Expands every compressed quantum of the device, called with the
+ * semaphore held for writing.
+ */
+static int scull_zexpand_all(struct scull_dev *dev)
+{
+	struct scull_qset *dptr;
+	unsigned long item;
+	size_t s_pos;
+	void *quant;
+
+	xa_for_each(dev->data, item, dptr) {
+		if (!dptr->data)
+			continue;
+
+		for (s_pos = 0; s_pos < dev->qset && dev->zquanta; s_pos++) {
+			if (!dptr->data[s_pos] || !scull_zquant(dptr->data[s_pos]))
+				continue;
+
+			quant = scull_zexpand(dev, &dptr->data[s_pos]);
+			if (IS_ERR(quant))
+				return PTR_ERR(quant);
+		}
+
+		if (!dev->zquanta)
+			break;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/*
+ * Reads from a compressed quantum through the device's small cache of
+ * decompressed ones, called with the semaphore held for reading.
+ */
+static ssize_t scull_zread(struct scull_dev *dev, void *quant, size_t q_pos,
+		size_t count, struct iov_iter *to)
+{
+	struct scull_zcache *zc = NULL;
+	ssize_t ret;
+	int i;
+
+	mutex_lock(&dev->zcache_lock);
+
+	for (i = 0; i < SCULL_ZCACHE; i++) {
+		if (dev->zcache[i].key == quant) {
+			zc = &dev->zcache[i];
+			break;
+		}
+	}
+
+	if (!zc) {
+		zc = &dev->zcache[dev->zcache_next];
+		dev->zcache_next = (dev->zcache_next + 1) % SCULL_ZCACHE;
+		zc->key = NULL;
+
+		if (zc->size != dev->quantum) {
+			kvfree(zc->buf);
+			zc->size = 0;
+			zc->buf = kvmalloc(dev->quantum, GFP_KERNEL);
+			if (!zc->buf) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			zc->size = dev->quantum;
+		}
+
+		ret = scull_zdecompress(dev, quant, zc->buf);
+		if (ret)
+			goto out;
+		zc->key = quant;
+	}
+
+	ret = copy_to_iter(zc->buf + q_pos, count, to);
+
+out:
+	mutex_unlock(&dev->zcache_lock);
+	return ret;
+}
+
+/*
+ * Quantum sets live in an xarray keyed by item number, so finding the one
+ * backing a given offset costs the same no matter how far into the device
+ * it is.
+ */
+static struct scull_qset* scull_follow(struct scull_dev *dev, size_t item)
+{
+	return xa_load(dev->data, item);
+}
+
+static int scull_down_read(struct scull_dev *dev)
+{
+	if (down_read_trylock(&dev->sem))
+		return 0;
+
+	this_cpu_inc(dev->stats->read_contended);
+	return down_read_killable(&dev->sem);
+}
+
+static int scull_down_write(struct scull_dev *dev)
+{
+	if (down_write_trylock(&dev->sem))
+		return 0;
+
+	this_cpu_inc(dev->stats->write_contended);
+	return down_write_killable(&dev->sem);
+}
+
+/* Called with the semaphore held, for reading at least. */
+static struct scull_qset *scull_cursor_follow(struct scull_file *sf, size_t item)
+{
+	struct scull_dev *dev = sf->dev;
+	struct scull_qset *dptr;
+
+	spin_lock(&sf->lock);
+
+	if (sf->dptr && sf->item == item && sf->gen == dev->gen) {
+		dptr = sf->dptr;
+	} else {
+		dptr = scull_follow(dev, item);
+		sf->dptr = dptr;
+		sf->item = item;
+		sf->gen = dev->gen;
+	}
+
+	spin_unlock(&sf->lock);
+	return dptr;
+}
+
+static ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scull_file *sf = iocb->ki_filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	struct scull_qset *dptr;
+	size_t quantum, qset, item_size;
+	size_t item, s_pos, q_pos, rest, count, copied;
+	loff_t pos = iocb->ki_pos, start_pos = pos;
+	size_t want = iov_iter_count(to);
+	ssize_t retval = 0, ret;
+	void *quant;
+	unsigned long size;
+	u64 start = trace_scull_read_enabled() ? ktime_get_ns() : 0;
+
+	if (scull_down_read(dev))
+		return -ERESTARTSYS;
+
+	quantum = dev->quantum;
+	qset = dev->qset;
+	item_size = quantum * qset;
+	size = READ_ONCE(dev->size);
+
+	while (iov_iter_count(to) && pos < size) {
+		item = pos / item_size;
+		rest = pos % item_size;
+
+		s_pos = rest / quantum;
+		q_pos = rest % quantum;
+
+		dptr = scull_cursor_follow(sf, item);
+
+		count = min_t(size_t, quantum - q_pos, size - pos);
+		count = min(count, iov_iter_count(to));
+
+		if (dptr && READ_ONCE(dev->zidle))
+			WRITE_ONCE(dptr->atime, jiffies);
+
+		/* Holes read back as zeros */
+		quant = dptr && dptr->data ? dptr->data[s_pos] : NULL;
+		if (!quant) {
+			copied = iov_iter_zero(count, to);
+		} else if (scull_zquant(quant)) {
+			ret = scull_zread(dev, quant, q_pos, count, to);
+			if (ret < 0) {
+				if (!retval)
+					retval = ret;
+				break;
+			}
+			copied = ret;
+		} else {
+			copied = copy_to_iter(quant + q_pos, count, to);
+		}
+		pos += copied;
+		retval += copied;
+
+		if (copied != count) {
+			if (!retval)
+				retval = -EFAULT;
+			break;
+		}
+	}
+
+	iocb->ki_pos = pos;
+	up_read(&dev->sem);
+
+	this_cpu_inc(dev->stats->reads);
+	if (retval > 0)
+		this_cpu_add(dev->stats->read_bytes, retval);
+
+	trace_scull_read(MINOR(dev->cdev.dev), start_pos, want, retval,
+			start ? ktime_get_ns() - start : 0);
+
+	return retval;
+}
+
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+	.release = generic_pipe_buf_release,
+	.get = generic_pipe_buf_get,
+};
+
+/* Decompresses part of a compressed quantum into a page of its own. */
+static ssize_t scull_zsplice_page(struct scull_dev *dev, void *quant,
+		size_t q_pos, size_t count, struct page **pagep)
+{
+	struct page *page;
+	struct iov_iter iter;
+	struct kvec kv;
+	ssize_t ret;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	kv.iov_base = page_address(page) + q_pos % PAGE_SIZE;
+	kv.iov_len = count;
+	iov_iter_kvec(&iter, READ, &kv, 1, count);
+
+	ret = scull_zread(dev, quant, q_pos, count, &iter);
+	if (ret != count) {
+		put_page(page);
+		return ret < 0 ? ret : -EFAULT;
+	}
+
+	*pagep = page;
+	return 0;
+}
+
+/*
+ * Page quanta are spliced by reference: every pipe buffer holds a page of
+ * a quantum and nothing is copied. Holes go out as the zero page and
+ * compressed quanta are decompressed into a page of their own. Sub-page
+ * quanta don't fill pages and go through read_iter instead.
+ *
+ * As with the page cache, data sitting in the pipe follows later writes
+ * to the device, and stays valid if the device is trimmed.
+ */
+static ssize_t scull_splice_read(struct file *filp, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	struct scull_qset *dptr;
+	size_t quantum, item_size;
+	size_t item, s_pos, q_pos, rest, count;
+	loff_t pos = *ppos, start_pos = pos;
+	size_t want = len;
+	ssize_t retval = 0, ret;
+	struct pipe_buffer buf;
+	unsigned long size;
+	void *quant;
+	u64 start = trace_scull_read_enabled() ? ktime_get_ns() : 0;
+
+	if (scull_down_read(dev))
+		return -ERESTARTSYS;
+
+	quantum = dev->quantum;
+	if (quantum < PAGE_SIZE) {
+		up_read(&dev->sem);
+		return generic_file_splice_read(filp, ppos, pipe, len, flags);
+	}
+
+	item_size = quantum * dev->qset;
+	size = READ_ONCE(dev->size);
+
+	while (len && pos < size) {
+		item = pos / item_size;
+		rest = pos % item_size;
+
+		s_pos = rest / quantum;
+		q_pos = rest % quantum;
+
+		dptr = scull_cursor_follow(sf, item);
+
+		count = min_t(size_t, PAGE_SIZE - q_pos % PAGE_SIZE, size - pos);
+		count = min(count, len);
+
+		buf = (struct pipe_buffer) {
+			.ops = &scull_pipe_buf_ops,
+			.offset = q_pos % PAGE_SIZE,
+			.len = count,
+		};
+
+		quant = dptr && dptr->data ? dptr->data[s_pos] : NULL;
+		if (!quant) {
+			buf.page = ZERO_PAGE(0);
+			get_page(buf.page);
+		} else if (scull_zquant(quant)) {
+			ret = scull_zsplice_page(dev, quant, q_pos, count, &buf.page);
+			if (ret) {
+				if (!retval)
+					retval = ret;
+				break;
+			}
+		} else {
+			buf.page = virt_to_page(quant + q_pos);
+			get_page(buf.page);
+		}
+
+		/* Drops the page reference itself when the pipe is full */
+		ret = add_to_pipe(pipe, &buf);
+		if (ret < 0) {
+			if (!retval)
+				retval = ret;
+			break;
+		}
+
+		pos += ret;
+		retval += ret;
+		len -= ret;
+	}
+
+	*ppos = pos;
+	up_read(&dev->sem);
+
+	this_cpu_inc(dev->stats->reads);
+	if (retval > 0)
+		this_cpu_add(dev->stats->read_bytes, retval);
+
+	trace_scull_read(MINOR(dev->cdev.dev), start_pos, want, retval,
+			start ? ktime_get_ns() - start : 0);
+
+	return retval;
+}
+
+/*
+ * The device is sparse: quanta that were never written stay NULL and read
+ * back as zeros. SEEK_DATA and SEEK_HOLE expose that layout at quantum
+ * granularity, called with the semaphore held.
+ */
+static loff_t scull_next_data(struct scull_dev *dev, loff_t pos, loff_t size)
+{
+	size_t quantum = dev->quantum, qset = dev->qset;
+	size_t item_size = quantum * qset;
+	unsigned long item = pos / item_size, start = item;
+	struct scull_qset *dptr;
+	size_t s_pos;
+	loff_t off;
+
+	while ((dptr = xa_find(dev->data, &item, ULONG_MAX, XA_PRESENT))) {
+		s_pos = item == start ? (pos % item_size) / quantum : 0;
+
+		if (dptr->data) {
+			for (; s_pos < qset; s_pos++) {
+				if (dptr->data[s_pos]) {
+					off = (loff_t) item * item_size + s_pos * quantum;
+					return min(max(off, pos), size);
+				}
+			}
+		}
+
+		if (item == ULONG_MAX)
+			break;
+		item++;
+	}
+
+	return size;
+}
+
+static loff_t scull_next_hole(struct scull_dev *dev, loff_t pos, loff_t size)
+{
+	size_t quantum = dev->quantum, qset = dev->qset;
+	size_t item_size = quantum * qset;
+	struct scull_qset *dptr;
+	size_t s_pos;
+	loff_t off = pos - pos % quantum;
+
+	while (off < size) {
+		dptr = scull_follow(dev, off / item_size);
+		if (!dptr || !dptr->data)
+			return max(off, pos);
+
+		for (s_pos = (off % item_size) / quantum; s_pos < qset && off < size;
+				s_pos++, off += quantum)
+			if (!dptr->data[s_pos])
+				return max(off, pos);
+	}
+
+	return size;
+}
+
+static loff_t scull_llseek(struct file *filp, loff_t off, int whence)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	loff_t size, pos;
+
+	if (down_read_killable(&dev->sem))
+		return -ERESTARTSYS;
+
+	size = READ_ONCE(dev->size);
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = off;
+		break;
+	case SEEK_CUR:
+		pos = filp->f_pos + off;
+		break;
+	case SEEK_END:
+		pos = size + off;
+		break;
+	case SEEK_DATA:
+		pos = off >= 0 && off < size ? scull_next_data(dev, off, size) : -ENXIO;
+		if (pos == size)
+			pos = -ENXIO;
+		break;
+	case SEEK_HOLE:
+		pos = off >= 0 && off < size ? scull_next_hole(dev, off, size) : -ENXIO;
+		break;
+	default:
+		pos = -EINVAL;
+	}
+
+	up_read(&dev->sem);
+
+	if (pos == -ENXIO)
+		return pos;
+
+	return vfs_setpos(filp, pos, MAX_LFS_FILESIZE);
+}
+
+/*
+ * Releases the quanta fully inside [offset, offset + len) and zeroes the
+ * partially covered ones. The size of the device doesn't change.
+ */
+static int scull_punch_hole(struct scull_dev *dev, loff_t offset, loff_t len)
+{
+	size_t quantum, item_size;
+	size_t item, s_pos, q_pos, rest;
+	struct scull_qset *dptr;
+	loff_t pos, next, end;
+	void *quant;
+	int ret = 0;
+
+	if (offset < 0 || len <= 0 || offset > LLONG_MAX - len)
+		return -EINVAL;
+
+	if (down_write_killable(&dev->sem))
+		return -ERESTARTSYS;
+
+	quantum = dev->quantum;
+	item_size = quantum * dev->qset;
+	end = min_t(loff_t, offset + len, dev->size);
+
+	for (pos = offset; pos < end; pos = next) {
+		item = pos / item_size;
+		rest = pos % item_size;
+
+		s_pos = rest / quantum;
+		q_pos = rest % quantum;
+		next = pos - q_pos + quantum;
+
+		dptr = scull_follow(dev, item);
+		if (!dptr || !dptr->data) {
+			next = (loff_t) (item + 1) * item_size;
+			continue;
+		}
+
+		quant = dptr->data[s_pos];
+		if (!quant)
+			continue;
+
+		if (q_pos == 0 && next <= end) {
+			dptr->data[s_pos] = NULL;
+			scull_quantum_release(dev, quant);
+			dev->nr_quanta--;
+			continue;
+		}
+
+		quant = scull_quantum_own(dev, &dptr->data[s_pos]);
+		if (IS_ERR(quant)) {
+			ret = PTR_ERR(quant);
+			break;
+		}
+		memset(quant + q_pos, 0, min(next, end) - pos);
+	}
+
+	up_write(&dev->sem);
+	return ret;
+}
+
+/*
+ * Drops up to nr quanta of a device in cache mode, from the front of the
+ * device, which for an append mostly cache holds the oldest data. Evicted
+ * quanta become holes and read back as zeros. Called with the semaphore
+ * held for writing.
+ */
+static unsigned long scull_evict(struct scull_dev *dev, unsigned long nr)
+{
+	void *batch[SCULL_POOL_BATCH];
+	struct scull_qset *dptr;
+	unsigned long item, freed = 0;
+	size_t s_pos, n = 0;
+
+	xa_for_each(dev->data, item, dptr) {
+		if (!dptr->data)
+			continue;
+
+		for (s_pos = 0; s_pos < dev->qset && freed < nr; s_pos++) {
+			if (!dptr->data[s_pos])
+				continue;
+
+			if (scull_zquant(dptr->data[s_pos])) {
+				scull_zrelease(dev, dptr->data[s_pos]);
+			} else {
+				scull_node_account(dev, dptr->data[s_pos], false);
+				batch[n++] = dptr->data[s_pos];
+			}
+			dptr->data[s_pos] = NULL;
+			freed++;
+
+			if (n == SCULL_POOL_BATCH) {
+				scull_quantum_free_bulk(dev, n, batch);
+				n = 0;
+			}
+		}
+
+		if (freed == nr)
+			break;
+	}
+
+	scull_quantum_free_bulk(dev, n, batch);
+	dev->nr_quanta -= freed;
+	dev->evicted += freed;
+	return freed;
+}
 
-#define SCULL_QUANTUM 6UL
-#define SCULL_QSET 4UL
+/*
+ * Quanta that can be evicted without losing anything the kernel can't
+ * free: pooled quanta of every device, and the data of devices in cache
+ * mode. Quanta shared with a snapshot or mapped writable are left alone,
+ * dropping them would not give memory back.
+ */
+static bool scull_evictable(struct scull_dev *dev)
+{
+	return READ_ONCE(dev->cache) && !READ_ONCE(dev->cow) &&
+		!atomic_read(&dev->nr_wmaps);
+}
 
-//ssize_t (*read) (struct file *, char __user *, size_t, loff_t *);
-//ssize_t (*write) (struct file *, const char __user *, size_t, loff_t *);
-//int (*open) (struct inode *, struct file *);
-//int (*release) (struct inode *, struct file *);
+static unsigned long scull_shrink_count(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	unsigned long count = 0;
+	int i;
 
-struct scull_qset
+	for (i = 0; i < scull_nr_devs; i++) {
+		count += READ_ONCE(scull_devices[i].pool_nr);
+		if (scull_evictable(&scull_devices[i]))
+			count += READ_ONCE(scull_devices[i].nr_quanta);
+	}
+
+	return count ? count : SHRINK_EMPTY;
+}
+
+/* Reclaim may run under a writer's semaphore, so devices are only tried. */
+static unsigned long scull_shrink_scan(struct shrinker *shrink,
+		struct shrink_control *sc)
 {
-	void **data;
-	struct scull_qset *next;
+	struct scull_dev *dev;
+	unsigned long freed = 0;
+	int i;
+
+	for (i = 0; i < scull_nr_devs && freed < sc->nr_to_scan; i++) {
+		dev = &scull_devices[i];
+
+		if (!down_write_trylock(&dev->sem))
+			continue;
+
+		freed += scull_pool_shrink(dev, sc->nr_to_scan - freed);
+		if (freed < sc->nr_to_scan && scull_evictable(dev))
+			freed += scull_evict(dev, sc->nr_to_scan - freed);
+
+		up_write(&dev->sem);
+	}
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker scull_shrinker = {
+	.count_objects = scull_shrink_count,
+	.scan_objects = scull_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
 };
 
-struct scull_dev
+static bool scull_shrinker_registered;
+
+static struct scull_qset* scull_add_qset(struct scull_dev *dev, size_t item)
 {
-	struct scull_qset *data;   /* Pointer to first quantum set */
-	size_t quantum;            /* the current quantum size */
-	size_t qset;               /* the current array size */
-	unsigned long size;        /* amount of data stored here */
-	// unsigned int access_key;   /* used by sculluid and scullpriv */
-	struct mutex lock;      /* mutual exlusion semaphore */
-	struct cdev cdev;          /* Char device structure */
-};
+	struct scull_qset *qset;
 
-struct scull_dev *sdev;
-struct proc_dir_entry *pentry;
+	qset = kzalloc_node(sizeof(struct scull_qset), GFP_KERNEL_ACCOUNT,
+			scull_index_node(dev));
+	if (!qset)
+		return NULL;
 
-static dev_t scull_major = 0; /* if set to 0, it will be allocated dynamically */
-static dev_t scull_minor = 0;
+	if (xa_is_err(xa_store(dev->data, item, qset, GFP_KERNEL_ACCOUNT))) {
+		kfree(qset);
+		return NULL;
+	}
 
-int scull_trim(struct scull_dev *dev)
+	dev->nr_qsets++;
+	return qset;
+}
+
+/*
+ * Returns the quantum at (item, s_pos), allocating the quantum set, its
+ * array and the quantum itself on the way if they are missing. Fails with
+ * -ENOSPC when a limit is reached and -ENOMEM when the allocator fails.
+ */
+static void *scull_alloc_quantum(struct scull_dev *dev, size_t item, size_t s_pos)
 {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset;
-	int i;
+	struct scull_qset *dptr;
+	void **data, *quant;
 
-	BUG_ON(!dev);
+	dptr = scull_follow(dev, item);
 
-	for (dptr = dev->data; dptr; dptr = next) {
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
-			kfree(dptr->data);
-			dptr->data = NULL;
-		}
-		next = dptr->next;
-		kfree(dptr);
+	if (dptr == NULL) {
+		dptr = scull_add_qset(dev, item);
+		if (dptr == NULL)
+			return ERR_PTR(-ENOMEM);
 	}
 
-	dev->size = 0;
-	dev->quantum = SCULL_QUANTUM;
-	dev->qset = SCULL_QSET;
-	dev->data = NULL;
-	return 0;
+	/* Faults walk the index locklessly, see scull_vma_fault() */
+	if (!dptr->data) {
+		data = kmem_cache_alloc_node(dev->qset_cache,
+				GFP_KERNEL_ACCOUNT | __GFP_ZERO, scull_index_node(dev));
+		if (!data)
+			return ERR_PTR(-ENOMEM);
+		smp_store_release(&dptr->data, data);
+	}
+
+	if (!dptr->data[s_pos]) {
+		if (dev->limit && (u64) (dev->nr_quanta + 1) * dev->quantum > dev->limit)
+			return ERR_PTR(-ENOSPC);
+
+		quant = scull_pool_get(dev);
+		if (!quant)
+			quant = scull_quantum_alloc(dev);
+		if (IS_ERR(quant))
+			return quant;
+
+		smp_store_release(&dptr->data[s_pos], quant);
+		scull_node_account(dev, quant, true);
+		dev->nr_quanta++;
+	}
+
+	dptr->atime = jiffies;
+	dptr->packed = false;
+
+	return scull_quantum_own(dev, &dptr->data[s_pos]);
 }
 
-static struct scull_qset* scull_follow(struct scull_dev *dev, size_t item)
+/*
+ * Drops the hold of an emptied snapshot on its origin, which stops copying
+ * on write once it has no snapshots left. The trim work of the snapshot
+ * has to drop its shared references first, the origin frees its quanta
+ * without looking at them from then on.
+ */
+static void scull_snapshot_unlink(struct scull_dev *snap)
 {
-	struct scull_qset *dptr = dev->data;
+	struct scull_dev *dev = xchg(&snap->origin, NULL);
+
+	if (!dev)
+		return;
+
+	flush_workqueue(scull_trim_wq);
+
+	down_write(&dev->sem);
+	if (!--dev->nr_snaps)
+		dev->cow = false;
+	up_write(&dev->sem);
+}
 
-	while(dev && item > 0) {
-		dptr = dptr->next;
-		--item;
+/*
+ * Creates a read-only snapshot of dev in a free snapshot minor and returns
+ * that minor. Only the index is copied: every quantum gets one more owner
+ * and is copied by the first writer that touches it, so the cost depends
+ * on the number of quanta and not on the amount of data.
+ */
+static int scull_snapshot(struct scull_dev *dev)
+{
+	struct scull_dev *snap = NULL;
+	struct scull_qset *dptr, *copy;
+	unsigned long item;
+	size_t s_pos;
+	int i, ret = 0;
+
+	if (dev->snapshot)
+		return -EINVAL;
+
+	mutex_lock(&scull_snap_lock);
+	for (i = scull_nr_devs; i < scull_nr_total; i++) {
+		if (!scull_devices[i].in_use && !scull_devices[i].nr_open) {
+			snap = &scull_devices[i];
+			snap->in_use = true;
+			break;
+		}
 	}
+	mutex_unlock(&scull_snap_lock);
 
-	return dptr;
+	if (!snap)
+		return -ENOSPC;
+
+	if (scull_down_write(dev)) {
+		ret = -ERESTARTSYS;
+		goto out_free_slot;
+	}
+
+	/* Writes through a shared mapping would bypass copy on write */
+	mutex_lock(&dev->map_lock);
+	if (atomic_read(&dev->nr_wmaps)) {
+		mutex_unlock(&dev->map_lock);
+		up_write(&dev->sem);
+		ret = -EBUSY;
+		goto out_free_slot;
+	}
+	dev->cow = true;
+	mutex_unlock(&dev->map_lock);
+
+	down_write(&snap->sem);
+
+	snap->quantum = dev->quantum;
+	snap->qset = dev->qset;
+	snap->quantum_cache = dev->quantum_cache;
+	snap->qset_cache = dev->qset_cache;
+	snap->gen++;
+	snap->cow = true;
+	snap->origin = dev;
+	dev->nr_snaps++;
+
+	xa_for_each(dev->data, item, dptr) {
+		copy = kzalloc(sizeof(struct scull_qset), GFP_KERNEL_ACCOUNT);
+		if (!copy)
+			goto nomem;
+
+		if (xa_is_err(xa_store(snap->data, item, copy, GFP_KERNEL_ACCOUNT))) {
+			kfree(copy);
+			goto nomem;
+		}
+		snap->nr_qsets++;
+
+		if (!dptr->data)
+			continue;
+
+		copy->data = kmem_cache_zalloc(dev->qset_cache, GFP_KERNEL_ACCOUNT);
+		if (!copy->data)
+			goto nomem;
+
+		for (s_pos = 0; s_pos < dev->qset; s_pos++) {
+			if (!dptr->data[s_pos])
+				continue;
+
+			if (scull_share_get(dptr->data[s_pos]))
+				goto nomem;
+
+			copy->data[s_pos] = dptr->data[s_pos];
+			scull_node_account(snap, copy->data[s_pos], true);
+			snap->nr_quanta++;
+			if (scull_zquant(copy->data[s_pos])) {
+				snap->zquanta++;
+				snap->zbytes += scull_zptr(copy->data[s_pos])->len;
+			}
+		}
+	}
+
+	snap->size = dev->size;
+	snap->cow_shared = snap->nr_quanta;
+	snap->cow_copied = 0;
+	dev->cow_shared += snap->nr_quanta;
+
+	up_write(&snap->sem);
+	up_write(&dev->sem);
+	return MINOR(snap->cdev.dev);
+
+nomem:
+	up_write(&snap->sem);
+	up_write(&dev->sem);
+
+	/* Keep the slot busy if it can't be emptied */
+	if (scull_trim(snap))
+		return -ENOMEM;
+	scull_snapshot_unlink(snap);
+	ret = -ENOMEM;
+
+out_free_slot:
+	mutex_lock(&scull_snap_lock);
+	snap->in_use = false;
+	mutex_unlock(&scull_snap_lock);
+	return ret;
 }
 
-static ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+static int scull_snapshot_delete(struct scull_dev *dev)
 {
-	struct scull_dev *dev = sdev;
+	int ret;
+
+	if (!dev->snapshot)
+		return -EINVAL;
+
+	ret = scull_trim(dev);
+	if (ret)
+		return ret;
+
+	scull_snapshot_unlink(dev);
+
+	mutex_lock(&scull_snap_lock);
+	dev->in_use = false;
+	mutex_unlock(&scull_snap_lock);
+	return 0;
+}
+
+/*
+ * Allocating the quanta changes the structure of the device and is done
+ * with the semaphore held for writing. The copy only touches quanta that
+ * already exist, so the semaphore is then downgraded and readers run
+ * while user data is pulled in. Other writers stay out until up_read().
+ */
+static ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scull_file *sf = iocb->ki_filp->private_data;
+	struct scull_dev *dev = sf->dev;
 	struct scull_qset *dptr;
-	size_t quantum = dev->quantum, qset = dev->qset;
-	size_t item_size = quantum * qset;
-	size_t item, s_pos, q_pos, rest, retval;
+	size_t quantum, qset, item_size;
+	size_t item, s_pos, q_pos, rest, count, copied, len, want;
+	loff_t pos, end, start_pos;
+	ssize_t retval = 0;
+	void *quant;
+	int err = 0;
+	u64 start = trace_scull_write_enabled() ? ktime_get_ns() : 0;
+
+	if (scull_down_write(dev))
+		return -ERESTARTSYS;
 
-        if(mutex_lock_interruptible(&dev->lock))
-          return -ERESTARTSYS;
+	quantum = dev->quantum;
+	qset = dev->qset;
+	item_size = quantum * qset;
 
-	item = *f_pos / item_size;
-	rest = *f_pos % item_size;
+	pos = (iocb->ki_flags & IOCB_APPEND) ? dev->size : iocb->ki_pos;
+	len = iov_iter_count(from);
+	start_pos = pos;
+	want = len;
 
-	s_pos = rest / quantum;
-	q_pos = rest % quantum;
+	end = pos;
+	while (end < pos + len) {
+		item = end / item_size;
+		rest = end % item_size;
 
-	dptr = scull_follow(dev, item);
+		s_pos = rest / quantum;
+		q_pos = rest % quantum;
+
+		quant = scull_alloc_quantum(dev, item, s_pos);
+		if (IS_ERR(quant)) {
+			err = PTR_ERR(quant);
+			break;
+		}
 
-	printk(KERN_DEBUG "dptr %p item %lu s_pos %lu q_pos %lu\n",
-			dptr, item, s_pos, q_pos);
+		end += quantum - q_pos;
+	}
 
-	if (dptr == NULL || !dptr->data || !dptr->data[s_pos]) {
-		printk(KERN_DEBUG "EOF\n");
-		retval = 0;
+	/* Short write up to a limit, the next one fails like a full disk */
+	if (end == pos) {
+		up_write(&dev->sem);
+		retval = err;
 		goto out;
 	}
 
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+	len = min_t(size_t, len, end - pos);
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
+	downgrade_write(&dev->sem);
+
+	while (len) {
+		item = pos / item_size;
+		rest = pos % item_size;
+
+		s_pos = rest / quantum;
+		q_pos = rest % quantum;
+
+		dptr = scull_cursor_follow(sf, item);
+		count = min(quantum - q_pos, len);
+
+		copied = copy_from_iter(dptr->data[s_pos] + q_pos, count, from);
+		pos += copied;
+		retval += copied;
+		len -= copied;
+
+		if (copied != count) {
+			if (!retval)
+				retval = -EFAULT;
+			break;
+		}
 	}
 
-	*f_pos += count;
-	retval = count;
+	if (pos > dev->size)
+		WRITE_ONCE(dev->size, pos);
+
+	iocb->ki_pos = pos;
+	up_read(&dev->sem);
 
 out:
-	mutex_unlock(&dev->lock);
+	this_cpu_inc(dev->stats->writes);
+	if (retval > 0)
+		this_cpu_add(dev->stats->write_bytes, retval);
+
+	trace_scull_write(MINOR(dev->cdev.dev), start_pos, want, retval,
+			start ? ktime_get_ns() - start : 0);
+
 	return retval;
 }
 
-static struct scull_qset* scull_add_qset(struct scull_dev *dev)
+/*
+ * Geometry can only be changed while the device holds no data, otherwise
+ * the existing quanta would no longer match the offsets computed from it.
+ */
+static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	struct scull_qset **qset_parents_ptr = &dev->data;
-	struct scull_qset *qset = *qset_parents_ptr;
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	int __user *uarg = (int __user *) arg;
+	struct scull_trim_stats trim_stats;
+	struct scull_range range;
+	u64 limit;
+	int val, retval = 0;
+
+	if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC || _IOC_NR(cmd) > SCULL_IOC_MAXNR)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case SCULL_IOCGQUANTUM:
+		return put_user(dev->quantum, uarg);
+	case SCULL_IOCGQSET:
+		return put_user(dev->qset, uarg);
+	case SCULL_IOCTRUNC:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return scull_trim(dev);
+	case SCULL_IOCPUNCHHOLE:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&range, (void __user *) arg, sizeof(range)))
+			return -EFAULT;
+		if (range.offset > LLONG_MAX || range.len > LLONG_MAX)
+			return -EINVAL;
+		return scull_punch_hole(dev, range.offset, range.len);
+	case SCULL_IOCSNAPSHOT:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return scull_snapshot(dev);
+	case SCULL_IOCSNAPDEL:
+		return scull_snapshot_delete(dev);
+	case SCULL_IOCGTRIMSTATS:
+		spin_lock(&dev->stats_lock);
+		trim_stats = dev->trim_stats;
+		spin_unlock(&dev->stats_lock);
+		if (copy_to_user((void __user *) arg, &trim_stats, sizeof(trim_stats)))
+			return -EFAULT;
+		return 0;
+	case SCULL_IOCSLIMIT:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (get_user(limit, (u64 __user *) arg))
+			return -EFAULT;
+		WRITE_ONCE(dev->limit, limit);
+		return 0;
+	case SCULL_IOCGLIMIT:
+		return put_user(READ_ONCE(dev->limit), (u64 __user *) arg);
+	case SCULL_IOCSCACHE:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (get_user(val, uarg))
+			return -EFAULT;
+		WRITE_ONCE(dev->cache, val != 0);
+		return 0;
+	case SCULL_IOCGCACHE:
+		return put_user(READ_ONCE(dev->cache), uarg);
+	case SCULL_IOCSCOMPRESS:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (get_user(val, uarg))
+			return -EFAULT;
+		if (val < 0)
+			return -EINVAL;
+		WRITE_ONCE(dev->zidle, msecs_to_jiffies(val));
+		if (val) {
+			mod_delayed_work(system_unbound_wq, &dev->zwork, dev->zidle);
+			return 0;
+		}
+		/* Turning compression off expands the device, so it can be mapped */
+		cancel_delayed_work_sync(&dev->zwork);
+		if (down_write_killable(&dev->sem))
+			return -ERESTARTSYS;
+		retval = scull_zexpand_all(dev);
+		up_write(&dev->sem);
+		return retval;
+	case SCULL_IOCGCOMPRESS:
+		return put_user(jiffies_to_msecs(READ_ONCE(dev->zidle)), uarg);
+	case SCULL_IOCSNUMA:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (get_user(val, uarg))
+			return -EFAULT;
+		if (!scull_numa_valid(val))
+			return -EINVAL;
+		if (down_write_killable(&dev->sem))
+			return -ERESTARTSYS;
+		WRITE_ONCE(dev->numa, val);
+		/* Pooled quanta were placed by the old policy */
+		scull_pool_drain(dev);
+		up_write(&dev->sem);
+		if (dev->pool)
+			schedule_work(&dev->pool_work);
+		return 0;
+	case SCULL_IOCGNUMA:
+		return put_user(READ_ONCE(dev->numa), uarg);
+	case SCULL_IOCSQUANTUM:
+	case SCULL_IOCSQSET:
+		break;
+	default:
+		return -ENOTTY;
+	}
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (get_user(val, uarg))
+		return -EFAULT;
+
+	if (val <= 0)
+		return -EINVAL;
 
-	while (qset) {
-		qset_parents_ptr = &qset->next;
-		qset = qset->next;
+	if (down_write_killable(&dev->sem))
+		return -ERESTARTSYS;
+
+	/* Faults read the geometry without the semaphore */
+	mutex_lock(&dev->map_lock);
+	if (!xa_empty(dev->data) || atomic_read(&dev->nr_maps)) {
+		retval = -EBUSY;
+		goto out;
+	}
+
+	if (cmd == SCULL_IOCSQUANTUM) {
+		if (scull_quantum_valid(val))
+			retval = scull_set_geometry(dev, val, dev->qset);
+		else
+			retval = -EINVAL;
+	} else {
+		if (scull_qset_valid(val))
+			retval = scull_set_geometry(dev, dev->quantum, val);
+		else
+			retval = -EINVAL;
 	}
 
-	*qset_parents_ptr = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
-	return *qset_parents_ptr;
+out:
+	mutex_unlock(&dev->map_lock);
+	up_write(&dev->sem);
+	return retval;
 }
 
-static ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * Pages are looked up on fault and the quantum's page reference keeps them
+ * alive for as long as they stay mapped. Offsets past the end of the
+ * device and unwritten quanta raise SIGBUS.
+ *
+ * Reads and writes copy to and from user memory with the semaphore held,
+ * so they can fault here: the fault must not take the semaphore at all, a
+ * writer queued in between would deadlock them. The index is walked under
+ * RCU instead. Arrays and the index itself are only freed by
+ * scull_free_data() after a grace period, and a quantum that gets released
+ * meanwhile is caught by checking its slot again once its page is pinned.
+ * The geometry can't change while the device is mapped, and mapped devices
+ * have no compressed quanta to expand, see scull_mmap().
+ */
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
 {
-	struct scull_dev *dev = sdev;
+	struct scull_dev *dev = vmf->vma->vm_private_data;
+	loff_t pos = (loff_t) vmf->pgoff << PAGE_SHIFT;
+	size_t quantum = dev->quantum, item_size = quantum * dev->qset;
+	size_t item, s_pos, q_pos, rest;
 	struct scull_qset *dptr;
-	size_t quantum = dev->quantum, qset = dev->qset;
-	size_t item_size = quantum * qset;
-	size_t qset_free_space;
-	size_t item, s_pos, q_pos, rest, retval;
+	struct page *page;
+	void **data, *quant;
 
-	if(mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
+	if (pos >= READ_ONCE(dev->size))
+		return VM_FAULT_SIGBUS;
 
-	item = *f_pos / item_size;
-	rest = *f_pos % item_size;
+	item = pos / item_size;
+	rest = pos % item_size;
 
 	s_pos = rest / quantum;
 	q_pos = rest % quantum;
 
-	dptr = scull_follow(dev, item);
+	rcu_read_lock();
 
-	if (dptr == NULL) {
-		dptr = scull_add_qset(dev);
-		if (dptr == NULL) {
-			retval = -ENOMEM;
-			goto out;
-		}
+retry:
+	dptr = xa_load(smp_load_acquire(&dev->data), item);
+	data = dptr ? smp_load_acquire(&dptr->data) : NULL;
+	quant = data ? smp_load_acquire(&data[s_pos]) : NULL;
+
+	if (!quant || WARN_ON_ONCE(scull_zquant(quant))) {
+		rcu_read_unlock();
+		return VM_FAULT_SIGBUS;
 	}
 
-	if (!dptr->data) {
-		dptr->data = kzalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data) {
-			retval = -ENOMEM;
-			goto out;
-		}
+	page = virt_to_page(quant + q_pos);
+	if (!folio_try_get(page_folio(page)))
+		goto retry;
+
+	if (READ_ONCE(data[s_pos]) != quant) {
+		folio_put(page_folio(page));
+		goto retry;
 	}
 
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kzalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos]) {
-			retval = -ENOMEM;
+	rcu_read_unlock();
+
+	vmf->page = page;
+	return 0;
+}
+
+static bool scull_vma_writable(struct vm_area_struct *vma)
+{
+	return (vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) == (VM_SHARED | VM_MAYWRITE);
+}
+
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->nr_maps);
+	if (scull_vma_writable(vma))
+		atomic_inc(&dev->nr_wmaps);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->nr_maps);
+	if (scull_vma_writable(vma))
+		atomic_dec(&dev->nr_wmaps);
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+	.open = scull_vma_open,
+	.close = scull_vma_close,
+	.fault = scull_vma_fault,
+};
+
+/*
+ * Only page sized or larger quanta are page aligned and backed by the
+ * page allocator, smaller ones can't be mapped.
+ */
+static int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	int ret = 0;
+
+	/*
+	 * mmap_lock is held here, and reads and writes fault on user memory
+	 * with the semaphore held, so it can't be taken: map_lock is enough
+	 * to order the mapping against geometry changes, compression and
+	 * snapshots.
+	 */
+	if (mutex_lock_killable(&dev->map_lock))
+		return -ERESTARTSYS;
+
+	if (dev->quantum < PAGE_SIZE) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Faults can't expand quanta, compression must be turned off first */
+	if (READ_ONCE(dev->zquanta)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	/*
+	 * Stores through a shared writable mapping can't be caught to copy
+	 * quanta shared with a snapshot, so the two exclude each other.
+	 */
+	if (scull_vma_writable(vma)) {
+		if (READ_ONCE(dev->cow)) {
+			ret = -EBUSY;
 			goto out;
 		}
+		atomic_inc(&dev->nr_wmaps);
 	}
 
-	qset_free_space = quantum - q_pos;
-	if (count > qset_free_space)
-		count = qset_free_space;
+	atomic_inc(&dev->nr_maps);
+	mutex_unlock(&dev->map_lock);
 
-	if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto out;
+	vma->vm_ops = &scull_vm_ops;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = dev;
+	return 0;
+
+out:
+	mutex_unlock(&dev->map_lock);
+	return ret;
+}
+
+/*
+ * /proc/scullmem reports one line per device, through seq_file so the
+ * number of devices is not limited by the size of a page.
+ */
+static void *scull_seq_start(struct seq_file *s, loff_t *pos)
+{
+	if (*pos == 0)
+		return SEQ_START_TOKEN;
+
+	if (*pos > scull_nr_total)
+		return NULL;
+
+	return &scull_devices[*pos - 1];
+}
+
+static void *scull_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	(*pos)++;
+	return scull_seq_start(s, pos);
+}
+
+static void scull_seq_stop(struct seq_file *s, void *v)
+{
+}
+
+/* Placement policy and bytes held on each node. */
+static void scull_seq_show_numa(struct seq_file *s, struct scull_dev *dev)
+{
+	unsigned long *bytes;
+	int node;
+
+	node = READ_ONCE(dev->numa);
+	if (node == SCULL_NUMA_LOCAL)
+		seq_puts(s, " local");
+	else if (node == SCULL_NUMA_INTERLEAVE)
+		seq_puts(s, " interleave");
+	else
+		seq_printf(s, " node%d", node);
+
+	bytes = kcalloc(nr_node_ids, sizeof(unsigned long), GFP_KERNEL);
+	if (!bytes)
+		return;
+
+	down_read(&dev->sem);
+	memcpy(bytes, dev->node_bytes, nr_node_ids * sizeof(unsigned long));
+	up_read(&dev->sem);
+
+	for_each_node_state(node, N_MEMORY)
+		seq_printf(s, " N%d=%lu", node, bytes[node]);
+
+	kfree(bytes);
+}
+
+static int scull_seq_show(struct seq_file *s, void *v)
+{
+	struct scull_dev *dev = v;
+	struct scull_stats sum = { 0 };
+	struct scull_stats *st;
+	unsigned long size, quantum, qset, nr_qsets, nr_quanta, alloc;
+	unsigned long cow_shared, cow_copied, evicted, zquanta, zbytes, zratio;
+	u64 limit, zdecomp, zdecomp_ns, zdecomp_max_ns;
+	int cpu;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_puts(s, "dev size quantum qset qsets quanta alloc_bytes "
+				"reads read_bytes writes write_bytes "
+				"read_contended write_contended "
+				"cow_shared cow_copied limit evicted "
+				"zquanta zbytes zratio decomps decomp_avg_ns decomp_max_ns "
+				"numa N<node>=bytes...\n");
+		return 0;
+	}
+
+	down_read(&dev->sem);
+	size = dev->size;
+	quantum = dev->quantum;
+	qset = dev->qset;
+	nr_qsets = dev->nr_qsets;
+	nr_quanta = dev->nr_quanta;
+	cow_shared = dev->cow_shared;
+	cow_copied = dev->cow_copied;
+	limit = dev->limit;
+	evicted = dev->evicted;
+	zquanta = dev->zquanta;
+	zbytes = dev->zbytes;
+	up_read(&dev->sem);
+
+	spin_lock(&dev->stats_lock);
+	zdecomp = dev->zdecomp;
+	zdecomp_ns = dev->zdecomp_ns;
+	zdecomp_max_ns = dev->zdecomp_max_ns;
+	spin_unlock(&dev->stats_lock);
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(dev->stats, cpu);
+		sum.reads += st->reads;
+		sum.read_bytes += st->read_bytes;
+		sum.writes += st->writes;
+		sum.write_bytes += st->write_bytes;
+		sum.read_contended += st->read_contended;
+		sum.write_contended += st->write_contended;
 	}
 
-	if (count == qset_free_space && !dptr->data)
-		dptr->data = kzalloc(qset * sizeof(char *), GFP_KERNEL);
+	alloc = (nr_quanta - zquanta) * quantum + zbytes +
+		nr_qsets * (sizeof(struct scull_qset) + qset * sizeof(void *));
 
-	*f_pos += count;
-	retval = count;
+	/* Uncompressed over compressed size, in hundredths */
+	zratio = zbytes ? zquanta * quantum * 100 / zbytes : 0;
 
-out:
-	mutex_unlock(&dev->lock);
-	return retval;
+	seq_printf(s, "%td %lu %lu %lu %lu %lu %lu %llu %llu %llu %llu %llu %llu %lu %lu %llu %lu "
+			"%lu %lu %lu.%02lu %llu %llu %llu",
+			dev - scull_devices, size, quantum, qset,
+			nr_qsets, nr_quanta, alloc,
+			sum.reads, sum.read_bytes, sum.writes, sum.write_bytes,
+			sum.read_contended, sum.write_contended,
+			cow_shared, cow_copied, limit, evicted,
+			zquanta, zbytes, zratio / 100, zratio % 100,
+			zdecomp, zdecomp ? div64_u64(zdecomp_ns, zdecomp) : 0, zdecomp_max_ns);
+
+	scull_seq_show_numa(s, dev);
+	seq_putc(s, '\n');
+	return 0;
 }
 
+static const struct seq_operations scull_seq_ops = {
+	.start = scull_seq_start,
+	.next = scull_seq_next,
+	.stop = scull_seq_stop,
+	.show = scull_seq_show,
+};
+
 static int get_dev(void)
 {
 	dev_t dev;
-
+	int ret;
 
 	if (scull_major) {
 		dev = MKDEV(scull_major, scull_minor);
-		return register_chrdev_region(dev, 1 /* nr of devs */, "scull");
+		return register_chrdev_region(dev, scull_nr_total, "scull");
 	}
 
+	ret = alloc_chrdev_region(&dev, scull_minor, scull_nr_total, "scull");
+	if (ret)
+		return ret;
+
 	scull_major = MAJOR(dev);
-	return alloc_chrdev_region(&dev, scull_minor, 1 /* nr of devs */, "scull");
+	return 0;
 }
 
 int scull_open(struct inode *inode, struct file *filp)
 {
 	struct scull_dev *dev = container_of(inode->i_cdev, struct scull_dev, cdev);
-	filp->private_data = dev;
+	struct scull_file *sf;
+	int ret;
+
+	if (dev->snapshot) {
+		if (filp->f_mode & FMODE_WRITE)
+			return -EROFS;
+
+		mutex_lock(&scull_snap_lock);
+		ret = dev->in_use ? 0 : -ENODEV;
+		if (!ret)
+			dev->nr_open++;
+		mutex_unlock(&scull_snap_lock);
+
+		if (ret)
+			return ret;
+	}
+
+	sf = kzalloc(sizeof(struct scull_file), GFP_KERNEL);
+	if (!sf) {
+		ret = -ENOMEM;
+		goto fail;
+	}
 
+	sf->dev = dev;
+	spin_lock_init(&sf->lock);
+
+	if ((filp->f_mode & FMODE_WRITE) && (filp->f_flags & O_TRUNC)) {
+		ret = scull_trim(dev);
+		if (ret)
+			goto fail;
+	}
+
+	filp->private_data = sf;
 	return 0;
+
+fail:
+	kfree(sf);
+	if (dev->snapshot) {
+		mutex_lock(&scull_snap_lock);
+		dev->nr_open--;
+		mutex_unlock(&scull_snap_lock);
+	}
+	return ret;
 }
 
 int scull_release(struct inode *inode, struct file *filp)
 {
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+
+	if (dev->snapshot) {
+		mutex_lock(&scull_snap_lock);
+		dev->nr_open--;
+		mutex_unlock(&scull_snap_lock);
+	}
+
+	kfree(sf);
 	return 0;
 }
 
 static struct file_operations fops =
 {
 	.owner = THIS_MODULE,
-	.read = scull_read,
-	.write = scull_write,
+	.llseek = scull_llseek,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
+	.unlocked_ioctl = scull_ioctl,
+	.mmap = scull_mmap,
 	.open = scull_open,
 	.release = scull_release
 };
 
+static int scull_setup_dev(struct scull_dev *dev)
+{
+	dev->size = 0;
+	dev->limit = scull_dev_limit;
+	dev->numa = scull_numa;
+	dev->numa_next = first_memory_node;
+	init_rwsem(&dev->sem);
+	spin_lock_init(&dev->stats_lock);
+	spin_lock_init(&dev->pool_lock);
+	INIT_WORK(&dev->pool_work, scull_pool_refill);
+	INIT_DELAYED_WORK(&dev->zwork, scull_zwork_fn);
+	mutex_init(&dev->zcache_lock);
+	mutex_init(&dev->map_lock);
+
+	dev->stats = alloc_percpu(struct scull_stats);
+	if (!dev->stats)
+		return -ENOMEM;
+
+	dev->node_bytes = kcalloc(nr_node_ids, sizeof(unsigned long), GFP_KERNEL);
+	if (!dev->node_bytes)
+		return -ENOMEM;
+
+	dev->data = kmalloc(sizeof(struct xarray), GFP_KERNEL);
+	if (!dev->data)
+		return -ENOMEM;
+	xa_init(dev->data);
+
+	if (scull_pool && !dev->snapshot) {
+		dev->pool = kcalloc(scull_pool, sizeof(void *), GFP_KERNEL);
+		if (!dev->pool)
+			return -ENOMEM;
+	}
+
+	if (scull_set_geometry(dev, scull_quantum, scull_qset))
+		return -ENOMEM;
+
+	cdev_init(&dev->cdev, &fops);
+	dev->cdev.owner = THIS_MODULE;
+	return 0;
+}
+
+/* Pending trims must have been flushed. */
+static void scull_free_dev(struct scull_dev *dev)
+{
+	struct scull_trim_work tw = {
+		.data = dev->data,
+		.quantum = dev->quantum,
+		.qset = dev->qset,
+		.quantum_cache = dev->quantum_cache,
+		.qset_cache = dev->qset_cache,
+		.cow = dev->cow,
+	};
+	int i;
+
+	WRITE_ONCE(dev->zidle, 0);
+	cancel_delayed_work_sync(&dev->zwork);
+	cancel_work_sync(&dev->pool_work);
+
+	if (dev->data)
+		scull_free_data(&tw);
+
+	for (i = 0; i < SCULL_ZCACHE; i++)
+		kvfree(dev->zcache[i].buf);
+
+	scull_pool_drain(dev);
+	kfree(dev->pool);
+	kfree(dev->node_bytes);
+	free_percpu(dev->stats);
+}
+
+static void scull_cleanup(int nr_added)
+{
+	int i;
+
+	for (i = 0; i < nr_added; i++)
+		cdev_del(&scull_devices[i].cdev);
+
+	destroy_workqueue(scull_trim_wq);
+
+	for (i = 0; i < nr_added; i++)
+		scull_free_dev(&scull_devices[i]);
+
+	kfree(scull_devices);
+	scull_caches_destroy();
+	xa_destroy(&scull_shared);
+	unregister_chrdev_region(MKDEV(scull_major, scull_minor), scull_nr_total);
+}
+
 static int scull_init(void)
 {
+	int i, ret;
+
 	printk(KERN_INFO "Loading scull\n");
 
-	if (get_dev()) {
+	if (!scull_quantum_valid(scull_quantum) || !scull_qset_valid(scull_qset)) {
+		printk(KERN_ERR "Invalid quantum %lu or qset %lu\n",
+				scull_quantum, scull_qset);
+		return -EINVAL;
+	}
+
+	if (scull_pool < 0 || scull_pool > SCULL_POOL_MAX) {
+		printk(KERN_ERR "Invalid pool size %d\n", scull_pool);
+		return -EINVAL;
+	}
+
+	if (!scull_numa_valid(scull_numa)) {
+		printk(KERN_ERR "Invalid NUMA policy %d\n", scull_numa);
+		return -EINVAL;
+	}
+
+	scull_nr_total = scull_nr_devs + scull_nr_snaps;
+
+	if (scull_nr_devs < 1 || scull_nr_snaps < 0 ||
+			scull_nr_total > SCULL_NR_DEVS_MAX) {
+		printk(KERN_ERR "Invalid number of devices %d or snapshots %d\n",
+				scull_nr_devs, scull_nr_snaps);
+		return -EINVAL;
+	}
+
+	ret = get_dev();
+	if (ret) {
 		printk(KERN_ERR "Failed to obtain dev major\n");
-		return -1;
+		return ret;
 	}
 
-	sdev = (struct scull_dev*) kmalloc(sizeof(struct scull_dev), GFP_KERNEL);
+	scull_trim_wq = alloc_workqueue("scull_trim", WQ_UNBOUND, 0);
+	scull_devices = kcalloc(scull_nr_total, sizeof(struct scull_dev), GFP_KERNEL);
 
-	if (!sdev) {
-		printk(KERN_ERR "Failed to allocate storage for scull dev struct\n");
+	if (!scull_trim_wq || !scull_devices) {
+		printk(KERN_ERR "Failed to allocate storage for scull dev structs\n");
+		if (scull_trim_wq)
+			destroy_workqueue(scull_trim_wq);
+		kfree(scull_devices);
+		unregister_chrdev_region(MKDEV(scull_major, scull_minor), scull_nr_total);
 		return -ENOMEM;
 	}
 
-	sdev->data = NULL;
-	sdev->quantum = SCULL_QUANTUM;
-	sdev->qset = SCULL_QSET;
-        mutex_init(&sdev->lock);
+	for (i = 0; i < scull_nr_total; i++) {
+		scull_devices[i].snapshot = i >= scull_nr_devs;
 
-	cdev_init(&sdev->cdev, &fops);
+		ret = scull_setup_dev(&scull_devices[i]);
+		if (unlikely(ret)) {
+			printk(KERN_ERR "Failed to set up device %d\n", i);
+			scull_free_dev(&scull_devices[i]);
+			scull_cleanup(i);
+			return ret;
+		}
 
-	if (unlikely(cdev_add(&sdev->cdev, scull_minor, 1 /* nr of dev numbers */))) {
-		printk(KERN_ERR "Failed to add cdev\n");
-		return -1;
+		ret = cdev_add(&scull_devices[i].cdev,
+				MKDEV(scull_major, scull_minor + i), 1);
+		if (unlikely(ret)) {
+			printk(KERN_ERR "Failed to add cdev %d\n", i);
+			scull_free_dev(&scull_devices[i]);
+			scull_cleanup(i);
+			return ret;
+		}
 	}
 
-	pentry = proc_create("scullmem", 0777, NULL, &fops);
+	pentry = proc_create_seq("scullmem", 0444, NULL, &scull_seq_ops);
 
 	if (unlikely(!pentry))
 		printk(KERN_ERR "Failed to create proc entry\n"); // continue even if failed
 
+	if (register_shrinker(&scull_shrinker, "scull"))
+		printk(KERN_ERR "Failed to register shrinker\n"); // continue even if failed
+	else
+		scull_shrinker_registered = true;
+
 	return 0;
 }
 
@@ -278,16 +2630,13 @@ static void scull_exit(void)
 {
 	printk(KERN_INFO "Removing scull\n");
 
-	if (!sdev)
-		return;
-
-	scull_trim(sdev);
-	cdev_del(&sdev->cdev);
-
 	if (pentry)
 		proc_remove(pentry);
 
-	kfree(sdev);
+	if (scull_shrinker_registered)
+		unregister_shrinker(&scull_shrinker);
+
+	scull_cleanup(scull_nr_total);
 }
 
 module_init(scull_init);
@@ -0,0 +1,73 @@
+#ifndef _SCULL_H_
+#define _SCULL_H_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Trim counters, times in nanoseconds. */
+struct scull_trim_stats
+{
+	__u64 trims;		/* number of trims requested */
+	__u64 pending;		/* detached indexes not freed yet */
+	__u64 detach_ns;	/* total time openers spent detaching */
+	__u64 detach_max_ns;
+	__u64 free_ns;		/* total time spent freeing in the background */
+	__u64 free_max_ns;
+};
+
+/* Byte range of a device, for SCULL_IOCPUNCHHOLE. */
+struct scull_range
+{
+	__u64 offset;
+	__u64 len;
+};
+
+/* Placement policies for SCULL_IOCSNUMA, any other value is a node. */
+#define SCULL_NUMA_LOCAL	-1
+#define SCULL_NUMA_INTERLEAVE	-2
+
+/*
+ * Ioctl interface of the scull device, shared with userspace.
+ * Sizes are passed by pointer as int.
+ *
+ * SCULL_IOCTRUNC empties the device like an O_TRUNC open does.
+ * SCULL_IOCPUNCHHOLE releases the quanta inside a range, which then reads
+ * back as zeros. It stands in for fallocate(FALLOC_FL_PUNCH_HOLE), which
+ * the VFS refuses on character devices.
+ * SCULL_IOCSNAPSHOT takes a copy-on-write snapshot of a device opened for
+ * writing and returns the read-only minor holding it, SCULL_IOCSNAPDEL
+ * issued on that minor releases it.
+ * SCULL_IOCSLIMIT caps the bytes of quanta a device may hold, writes past
+ * it fail with ENOSPC, 0 lifts the cap. It takes a __u64.
+ * SCULL_IOCSCACHE puts the device in cache mode: under memory pressure the
+ * kernel may drop its quanta, which then read back as zeros.
+ * SCULL_IOCSCOMPRESS takes an idle time in milliseconds: quanta not
+ * accessed for that long get compressed in the background, 0 stops it
+ * and expands them all again. mmap() fails with EBUSY while any quantum
+ * is compressed.
+ * SCULL_IOCSNUMA sets where new quanta are allocated: on the writer's
+ * node, interleaved over all nodes, or preferably on a given node.
+ */
+#define SCULL_IOC_MAGIC		'k'
+
+#define SCULL_IOCSQUANTUM	_IOW(SCULL_IOC_MAGIC, 1, int)
+#define SCULL_IOCSQSET		_IOW(SCULL_IOC_MAGIC, 2, int)
+#define SCULL_IOCGQUANTUM	_IOR(SCULL_IOC_MAGIC, 3, int)
+#define SCULL_IOCGQSET		_IOR(SCULL_IOC_MAGIC, 4, int)
+#define SCULL_IOCTRUNC		_IO(SCULL_IOC_MAGIC, 5)
+#define SCULL_IOCGTRIMSTATS	_IOR(SCULL_IOC_MAGIC, 6, struct scull_trim_stats)
+#define SCULL_IOCPUNCHHOLE	_IOW(SCULL_IOC_MAGIC, 7, struct scull_range)
+#define SCULL_IOCSNAPSHOT	_IO(SCULL_IOC_MAGIC, 8)
+#define SCULL_IOCSNAPDEL	_IO(SCULL_IOC_MAGIC, 9)
+#define SCULL_IOCSLIMIT		_IOW(SCULL_IOC_MAGIC, 10, __u64)
+#define SCULL_IOCGLIMIT		_IOR(SCULL_IOC_MAGIC, 11, __u64)
+#define SCULL_IOCSCACHE		_IOW(SCULL_IOC_MAGIC, 12, int)
+#define SCULL_IOCGCACHE		_IOR(SCULL_IOC_MAGIC, 13, int)
+#define SCULL_IOCSCOMPRESS	_IOW(SCULL_IOC_MAGIC, 14, int)
+#define SCULL_IOCGCOMPRESS	_IOR(SCULL_IOC_MAGIC, 15, int)
+#define SCULL_IOCSNUMA		_IOW(SCULL_IOC_MAGIC, 16, int)
+#define SCULL_IOCGNUMA		_IOR(SCULL_IOC_MAGIC, 17, int)
+
+#define SCULL_IOC_MAXNR		17
+
+#endif /* _SCULL_H_ */
@@ -0,0 +1,74 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(scull_rw,
+
+	TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret, u64 ns),
+
+	TP_ARGS(minor, pos, count, ret, ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	minor)
+		__field(loff_t,		pos)
+		__field(size_t,		count)
+		__field(ssize_t,	ret)
+		__field(u64,		ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor	= minor;
+		__entry->pos	= pos;
+		__entry->count	= count;
+		__entry->ret	= ret;
+		__entry->ns	= ns;
+	),
+
+	TP_printk("minor=%u pos=%lld count=%zu ret=%zd ns=%llu",
+		  __entry->minor, __entry->pos, __entry->count,
+		  __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(scull_rw, scull_read,
+	TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret, u64 ns),
+	TP_ARGS(minor, pos, count, ret, ns)
+);
+
+DEFINE_EVENT(scull_rw, scull_write,
+	TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret, u64 ns),
+	TP_ARGS(minor, pos, count, ret, ns)
+);
+
+TRACE_EVENT(scull_trim,
+
+	TP_PROTO(unsigned int minor, unsigned long nr_quanta, u64 detach_ns),
+
+	TP_ARGS(minor, nr_quanta, detach_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	minor)
+		__field(unsigned long,	nr_quanta)
+		__field(u64,		detach_ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor		= minor;
+		__entry->nr_quanta	= nr_quanta;
+		__entry->detach_ns	= detach_ns;
+	),
+
+	TP_printk("minor=%u nr_quanta=%lu detach_ns=%llu",
+		  __entry->minor, __entry->nr_quanta, __entry->detach_ns)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
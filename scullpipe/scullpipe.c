@@ -7,25 +7,113 @@
 #include <linux/compiler_attributes.h>
 #include <linux/semaphore.h>
 #include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+
+#include "scullpipe.h"
+
+#define CREATE_TRACE_POINTS
+#include "scullpipe_trace.h"
 
 #define SCULLP_BUF_SIZE 512
+#define SCULLP_BUF_MIN 64
+#define SCULLP_BUF_MAX (4 << 20)
+
+#define SCULLP_REC_MAX 4096
+#define SCULLP_REC_HDR sizeof(__u32)
+
+#define SCULLP_NR_DEVS 4
+#define SCULLP_NR_DEVS_MAX 256
 
 static dev_t scullpipe_major = 0;
 static dev_t scullpipe_minor = 0;
 
+static unsigned int scullpipe_buf_size = SCULLP_BUF_SIZE;
+module_param(scullpipe_buf_size, uint, S_IRUGO);
+MODULE_PARM_DESC(scullpipe_buf_size, "Initial buffer size, a power of two");
+
+static int scullpipe_nr_devs = SCULLP_NR_DEVS;
+module_param(scullpipe_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(scullpipe_nr_devs, "Number of independent pipes (minors) to create");
+
+static bool scullpipe_full_write = false;
+module_param(scullpipe_full_write, bool, S_IRUGO);
+MODULE_PARM_DESC(scullpipe_full_write, "Blocking writes wait until the whole request is written");
+
+static bool scullpipe_packet = false;
+module_param(scullpipe_packet, bool, S_IRUGO);
+MODULE_PARM_DESC(scullpipe_packet, "Start in packet mode, one record per write and per read");
+
+static unsigned int scullpipe_max_record = SCULLP_REC_MAX;
+module_param(scullpipe_max_record, uint, S_IRUGO);
+MODULE_PARM_DESC(scullpipe_max_record, "Largest record in packet mode");
+
+static unsigned int scullpipe_hiwat = 1;
+module_param(scullpipe_hiwat, uint, S_IRUGO);
+MODULE_PARM_DESC(scullpipe_hiwat, "Readers are woken once this many bytes are buffered");
+
+static unsigned int scullpipe_lowat = SCULLP_BUF_MAX;
+module_param(scullpipe_lowat, uint, S_IRUGO);
+MODULE_PARM_DESC(scullpipe_lowat, "Writers are woken once at most this many bytes are buffered");
+
+static unsigned int scullpipe_max_delay = 0;
+module_param(scullpipe_max_delay, uint, S_IRUGO);
+MODULE_PARM_DESC(scullpipe_max_delay, "Microseconds before readers are woken below hiwat, 0 for never");
+
 static int scullpipe_open (struct inode *, struct file *);
 static int scullpipe_release (struct inode *, struct file *);
 static ssize_t scullpipe_read (struct file *, char __user *, size_t, loff_t *);
 static ssize_t  scullpipe_write (struct file *, const char __user *, size_t, loff_t *);
+static long scullpipe_ioctl (struct file *, unsigned int, unsigned long);
+static __poll_t scullpipe_poll (struct file *, poll_table *);
+static int scullpipe_fasync (int, struct file *, int);
+static int scullpipe_mmap (struct file *, struct vm_area_struct *);
 
+/*
+ * The indices live in a header page of their own and bb in a vmalloc
+ * area, so that both can be mapped, see scullpipe_mmap(). ring->tail and
+ * ring->head are free running byte counts, masked with size - 1 to index
+ * bb, so head - tail is always the amount of data, even across the wrap.
+ *
+ * The reader only moves the tail and the writer only moves the head, each
+ * publishing its index with release semantics once it is done with the
+ * data, so readers and writers need no lock between them. rsem serializes
+ * the readers and wsem the writers, as several tasks can share a file,
+ * and resizing takes both.
+ *
+ * A mapped side can move its index behind our back, so the indices are
+ * read once and checked against size, which is our own copy.
+ */
 struct scullpipe_dev {
 	struct cdev cdev;
-	char *bb, *wp, *rp;
-	struct semaphore wsem;
+	struct scullpipe_ring *ring;
+	char *bb;
+	unsigned int size;
+	struct semaphore rsem, wsem;
+	atomic_t nr_maps;
+	bool full_write;           /* write like a pipe, see __scullpipe_write() */
+	bool packet;               /* records, see scullpipe_produce_rec() */
+	unsigned int max_record;
+	unsigned int hiwat, lowat;   /* see scullpipe_produced() */
+	unsigned int max_delay;      /* in us */
+	struct hrtimer delay_timer;
+	struct mutex resize_lock;
 	wait_queue_head_t rq, wq;
+	struct fasync_struct *async_queue;
+	atomic64_t bytes_written, bytes_read;
+	atomic64_t reader_wakeups, writer_wakeups;
 };
 
-struct scullpipe_dev *sdev;
+static void scullpipe_flush_readers (struct scullpipe_dev *);
+
+/* One per minor, each pipe has its own buffer, locks and wait queues. */
+struct scullpipe_dev *scullpipe_devices;
 
 static struct file_operations fops = {
 	.owner = THIS_MODULE,
@@ -33,27 +121,43 @@ static struct file_operations fops = {
 	.release = scullpipe_release,
 	.read = scullpipe_read,
 	.write = scullpipe_write,
+	.unlocked_ioctl = scullpipe_ioctl,
+	.poll = scullpipe_poll,
+	.fasync = scullpipe_fasync,
+	.mmap = scullpipe_mmap,
 };
 
 static int scullpipe_open (struct inode *inode, struct file *filp)
 {
-	filp->private_data = (void*) &sdev;
-	printk(KERN_DEBUG "Scullpipe open\n");
+	struct scullpipe_dev *sdev = container_of(inode->i_cdev, struct scullpipe_dev, cdev);
+
+	filp->private_data = sdev;
+
+	trace_scullpipe_open(iminor(inode), filp->f_mode);
 
 	return 0;
 }
 
 static int scullpipe_release (struct inode *inode, struct file *filp)
 {
-	printk(KERN_DEBUG "Scullpipe release");
+	struct scullpipe_dev *sdev = filp->private_data;
+
+	if (filp->f_mode & FMODE_WRITE)
+		scullpipe_flush_readers(sdev);
+
+	scullpipe_fasync(-1, filp, 0);
+
+	trace_scullpipe_release(iminor(inode), filp->f_mode);
 	return 0;
 }
 
-static __always_inline size_t readavail(const struct scullpipe_dev *sdev)
+/*
+ * The helpers below work on indices read once by the caller, the other
+ * side may move its own in the meantime.
+ */
+static __always_inline size_t readavail(u32 rp, u32 wp)
 {
-	if (sdev->wp < sdev->rp)
-		return (sdev->bb - sdev->rp) + SCULLP_BUF_SIZE; // I hope this prevents overflow to happen
-	return sdev->wp - sdev->rp;
+	return (u32)(wp - rp);
 }
 
 static __always_inline size_t scullmin(size_t a, size_t b)
@@ -64,167 +168,906 @@ static __always_inline size_t scullmin(size_t a, size_t b)
 
 static bool __always_inline cbempty(const struct scullpipe_dev *sdev)
 {
-	return sdev->rp == sdev->wp;
+	return READ_ONCE(sdev->ring->tail) == READ_ONCE(sdev->ring->head);
 }
 
-static ssize_t  scullpipe_read (struct file *filp, char __user *to, size_t count, loff_t *off)
+/*
+ * Returns -EAGAIN when there is nothing to read, -EIO when a mapping left
+ * the indices inconsistent.
+ */
+static ssize_t scullpipe_consume(struct scullpipe_dev *sdev, char __user *to, size_t count)
 {
-	struct scullpipe_dev *sdev = (struct scullpipe_dev *) filp->private_data;
+	/* Pairs with the writer's release, the data up to wp is visible */
+	u32 wp = smp_load_acquire(&sdev->ring->head);
+	u32 rp = READ_ONCE(sdev->ring->tail);
+	size_t off = rp & (sdev->size - 1), first;
 
-	if (down_interruptible(&sdev->wsem))
-		return -ERESTARTSYS;
+	if (rp == wp)
+		return -EAGAIN;
+	if (readavail(rp, wp) > sdev->size)
+		return -EIO;
 
-	while (sdev->rp == sdev->wp) {
-		up(&sdev->wsem);
+	/* Up to two segments, the second one from the start of bb */
+	count = scullmin(count, readavail(rp, wp));
+	first = scullmin(count, sdev->size - off);
 
-		if (filp->f_flags & O_NONBLOCK)
-			return -EAGAIN;
+	if (copy_to_user(to, sdev->bb + off, first))
+		return -EFAULT;
 
-		if (wait_event_interruptible(sdev->rq, (!cbempty(sdev))))
-			return -ERESTARTSYS;
+	if (copy_to_user(to + first, sdev->bb, count - first))
+		count = first;
 
-		if (down_interruptible(&sdev->wsem))
-			return -ERESTARTSYS;
-	}
+	/* The space is only handed back once the data has been read */
+	smp_store_release(&sdev->ring->tail, rp + count);
 
-	// There is data to read and semaphore is aquired
-	
-	count = scullmin(count, readavail(sdev));
+	return count;
+}
+
+/* Kernel side copies of a range of the ring, which may wrap. */
+static void ring_peek(const struct scullpipe_dev *sdev, u32 idx, void *to, size_t n)
+{
+	size_t off = idx & (sdev->size - 1), first = scullmin(n, sdev->size - off);
 
-	if (copy_to_user(to, sdev->rp, count)) {
-		up (&sdev->wsem);
+	memcpy(to, sdev->bb + off, first);
+	memcpy(to + first, sdev->bb, n - first);
+}
+
+static void ring_poke(struct scullpipe_dev *sdev, u32 idx, const void *from, size_t n)
+{
+	size_t off = idx & (sdev->size - 1), first = scullmin(n, sdev->size - off);
+
+	memcpy(sdev->bb + off, from, first);
+	memcpy(sdev->bb, from + first, n - first);
+}
+
+static int ring_to_user(const struct scullpipe_dev *sdev, u32 idx, char __user *to, size_t n)
+{
+	size_t off = idx & (sdev->size - 1), first = scullmin(n, sdev->size - off);
+
+	if (copy_to_user(to, sdev->bb + off, first) ||
+			copy_to_user(to + first, sdev->bb, n - first))
 		return -EFAULT;
+	return 0;
+}
+
+static int ring_from_user(struct scullpipe_dev *sdev, u32 idx, const char __user *from, size_t n)
+{
+	size_t off = idx & (sdev->size - 1), first = scullmin(n, sdev->size - off);
+
+	if (copy_from_user(sdev->bb + off, from, first) ||
+			copy_from_user(sdev->bb, from + first, n - first))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Length of the record at rp, or -EIO when it doesn't fit in the used
+ * part of the ring, which only a mapping can cause.
+ */
+static long scullpipe_rec_len(const struct scullpipe_dev *sdev, u32 rp, u32 wp)
+{
+	size_t used = readavail(rp, wp);
+	u32 len;
+
+	if (used > sdev->size || used < SCULLP_REC_HDR)
+		return -EIO;
+
+	ring_peek(sdev, rp, &len, sizeof(len));
+	if (len > used - SCULLP_REC_HDR)
+		return -EIO;
+
+	return len;
+}
+
+/*
+ * Packet mode counterpart of scullpipe_consume(), reads one record. What
+ * doesn't fit in count is dropped with the record, as on an O_DIRECT pipe.
+ */
+static ssize_t scullpipe_consume_rec(struct scullpipe_dev *sdev, char __user *to, size_t count)
+{
+	u32 wp = smp_load_acquire(&sdev->ring->head);
+	u32 rp = READ_ONCE(sdev->ring->tail);
+	long len;
+
+	if (rp == wp)
+		return -EAGAIN;
+
+	/* A zero length read only waits for data */
+	if (!count)
+		return 0;
+
+	len = scullpipe_rec_len(sdev, rp, wp);
+	if (len < 0)
+		return len;
+
+	count = scullmin(count, len);
+	if (ring_to_user(sdev, rp + SCULLP_REC_HDR, to, count))
+		return -EFAULT;
+
+	smp_store_release(&sdev->ring->tail, rp + SCULLP_REC_HDR + len);
+
+	return count;
+}
+
+/*
+ * Reads as many whole records as fit in the buffer and the index of the
+ * batch. Returns the number of records, -EMSGSIZE when the first one
+ * doesn't fit.
+ */
+static long scullpipe_consume_batch(struct scullpipe_dev *sdev, struct scullpipe_batch *b)
+{
+	u32 wp = smp_load_acquire(&sdev->ring->head);
+	u32 rp = READ_ONCE(sdev->ring->tail);
+	char __user *data = u64_to_user_ptr(b->data);
+	__u32 __user *index = u64_to_user_ptr(b->index);
+	long len, ret = 0;
+
+	if (rp == wp)
+		return -EAGAIN;
+
+	b->nr = 0;
+	b->bytes = 0;
+
+	while (rp != wp && b->nr < b->index_len) {
+		len = scullpipe_rec_len(sdev, rp, wp);
+		if (len < 0) {
+			ret = len;
+			break;
+		}
+
+		if (len > b->data_len - b->bytes) {
+			ret = -EMSGSIZE;
+			break;
+		}
+
+		if (ring_to_user(sdev, rp + SCULLP_REC_HDR, data + b->bytes, len) ||
+				put_user(len, index + b->nr)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		rp += SCULLP_REC_HDR + len;
+		b->bytes += len;
+		b->nr++;
 	}
 
-	sdev->rp += count;
+	if (!b->nr)
+		return ret;
 
-	if (sdev->rp == sdev->bb + SCULLP_BUF_SIZE)
-		sdev->rp = sdev->bb;
+	smp_store_release(&sdev->ring->tail, rp);
 
-	up(&sdev->wsem);
+	return b->nr;
+}
 
+/*
+ * Wakes the writers, then waits for data like any other read. A mapped
+ * reader uses it once it has moved the tail itself.
+ */
+static void scullpipe_read_doorbell(struct scullpipe_dev *sdev)
+{
+	atomic64_inc(&sdev->writer_wakeups);
 	wake_up_interruptible(&sdev->wq);
+	kill_fasync(&sdev->async_queue, SIGIO, POLL_OUT);
+}
 
-	return count;
+/* Same as scullpipe_read_doorbell(), for a mapped writer. */
+static void scullpipe_write_doorbell(struct scullpipe_dev *sdev)
+{
+	atomic64_inc(&sdev->reader_wakeups);
+	wake_up_interruptible(&sdev->rq);
+	kill_fasync(&sdev->async_queue, SIGIO, POLL_IN);
 }
 
-static bool __always_inline cbfull(const struct scullpipe_dev *sdev)
+static size_t __always_inline scullpipe_used(const struct scullpipe_dev *sdev)
 {
-	char * next = sdev->wp + 1;
+	return readavail(READ_ONCE(sdev->ring->tail), READ_ONCE(sdev->ring->head));
+}
 
-	if (next >= sdev->bb + SCULLP_BUF_SIZE)
-		next -= SCULLP_BUF_SIZE;
+/* Both watermarks are capped so that a full or empty buffer always wakes. */
+static size_t __always_inline scullpipe_hiwat_eff(const struct scullpipe_dev *sdev)
+{
+	return scullmin(READ_ONCE(sdev->hiwat), READ_ONCE(sdev->size));
+}
 
-	return next == sdev->rp;
+static size_t __always_inline scullpipe_lowat_eff(const struct scullpipe_dev *sdev)
+{
+	return scullmin(READ_ONCE(sdev->lowat), READ_ONCE(sdev->size) - 1);
 }
 
-static size_t __always_inline spacefree(const struct scullpipe_dev *sdev)
+/*
+ * Readers are only woken once hiwat bytes are buffered, writers once no
+ * more than lowat are, so that a stream of small writes or reads doesn't
+ * cost a context switch each. The defaults wake on every byte. Below
+ * hiwat, the delay timer bounds how long readers can miss data.
+ */
+static void scullpipe_produced(struct scullpipe_dev *sdev, size_t n)
 {
-	if (sdev->rp > sdev->wp)
-		return sdev->rp - sdev->wp;
+	unsigned int delay = READ_ONCE(sdev->max_delay);
+
+	atomic64_add(n, &sdev->bytes_written);
 
-	return (sdev->bb - sdev->wp) + SCULLP_BUF_SIZE;
+	if (scullpipe_used(sdev) >= scullpipe_hiwat_eff(sdev))
+		scullpipe_write_doorbell(sdev);
+	else if (delay && !hrtimer_is_queued(&sdev->delay_timer))
+		hrtimer_start(&sdev->delay_timer, us_to_ktime(delay), HRTIMER_MODE_REL);
 }
 
-static ssize_t scullpipe_write(struct file *filp, const char __user *from, size_t count, loff_t *off)
+static void scullpipe_consumed(struct scullpipe_dev *sdev, size_t n)
 {
-	struct scullpipe_dev *sdev = (struct scullpipe_dev *) filp->private_data;
+	atomic64_add(n, &sdev->bytes_read);
 
-	if (down_interruptible(&sdev->wsem))
-		return -ERESTARTSYS;
-	
-	while (cbfull(sdev)) {
-		up(&sdev->wsem);
+	if (scullpipe_used(sdev) <= scullpipe_lowat_eff(sdev))
+		scullpipe_read_doorbell(sdev);
+}
 
-		if (filp->f_flags & O_NONBLOCK)
-			return -EAGAIN;
+/*
+ * Wakes the readers for data left below hiwat, before a writer sleeps or
+ * goes away, so that the two sides can't end up waiting on each other.
+ */
+static void scullpipe_flush_readers(struct scullpipe_dev *sdev)
+{
+	if (!cbempty(sdev) && scullpipe_used(sdev) < scullpipe_hiwat_eff(sdev))
+		scullpipe_write_doorbell(sdev);
+}
+
+static enum hrtimer_restart scullpipe_delay_fn(struct hrtimer *timer)
+{
+	struct scullpipe_dev *sdev = container_of(timer, struct scullpipe_dev, delay_timer);
+
+	if (!cbempty(sdev))
+		scullpipe_write_doorbell(sdev);
+
+	return HRTIMER_NORESTART;
+}
+
+static ssize_t __scullpipe_read(struct file *filp, char __user *to, size_t count, loff_t *off)
+{
+	struct scullpipe_dev *sdev = filp->private_data;
+	ssize_t ret;
 
-		if (wait_event_interruptible(sdev->wq, (!cbfull(sdev)) ))
+	if (!count)
+		scullpipe_read_doorbell(sdev);
+
+	for (;;) {
+		if (down_interruptible(&sdev->rsem))
 			return -ERESTARTSYS;
 
-		if (down_interruptible(&sdev->wsem))
+		/* The mode only changes with both sides shut out */
+		if (READ_ONCE(sdev->packet))
+			ret = scullpipe_consume_rec(sdev, to, count);
+		else
+			ret = scullpipe_consume(sdev, to, count);
+		up(&sdev->rsem);
+
+		if (ret != -EAGAIN || (filp->f_flags & O_NONBLOCK))
+			break;
+
+		if (wait_event_interruptible(sdev->rq, (!cbempty(sdev))))
 			return -ERESTARTSYS;
 	}
 
-	// There is space and semaphore is aquired
-	
-	count = scullmin(count, spacefree(sdev));
+	if (ret > 0)
+		scullpipe_consumed(sdev, ret);
 
-	if (copy_from_user(sdev->wp, from, count)) {
-		up(&sdev->wsem);
+	return ret;
+}
+
+static bool __always_inline cbfull(const struct scullpipe_dev *sdev)
+{
+	return readavail(READ_ONCE(sdev->ring->tail), READ_ONCE(sdev->ring->head)) >=
+		READ_ONCE(sdev->size);
+}
+
+static size_t __always_inline spacefree(const struct scullpipe_dev *sdev, u32 rp, u32 wp)
+{
+	return sdev->size - readavail(rp, wp);
+}
+
+/* For wait conditions, without a lock. An inconsistent ring counts as room. */
+static bool __always_inline cbroom(const struct scullpipe_dev *sdev, size_t need)
+{
+	size_t used = readavail(READ_ONCE(sdev->ring->tail), READ_ONCE(sdev->ring->head));
+	size_t size = READ_ONCE(sdev->size);
+
+	return used > size || size - used >= need;
+}
+
+/*
+ * Returns -EAGAIN when there are less than need bytes of space, -EIO when
+ * a mapping left the indices inconsistent.
+ */
+static ssize_t scullpipe_produce(struct scullpipe_dev *sdev, const char __user *from,
+		size_t count, size_t need)
+{
+	/* Pairs with the reader's release, the space up to rp is free */
+	u32 rp = smp_load_acquire(&sdev->ring->tail);
+	u32 wp = READ_ONCE(sdev->ring->head);
+	size_t off = wp & (sdev->size - 1), first;
+	size_t space;
+
+	if (readavail(rp, wp) > sdev->size)
+		return -EIO;
+
+	space = spacefree(sdev, rp, wp);
+	if (!space || space < need)
+		return -EAGAIN;
+
+	/* Up to two segments, the second one at the start of bb */
+	count = scullmin(count, space);
+	first = scullmin(count, sdev->size - off);
+
+	if (copy_from_user(sdev->bb + off, from, first))
+		return -EFAULT;
+
+	if (copy_from_user(sdev->bb, from + first, count - first))
+		count = first;
+
+	/* The data is only published once it has been written */
+	smp_store_release(&sdev->ring->head, wp + count);
+
+	return count;
+}
+
+/*
+ * Packet mode counterpart of scullpipe_produce(): the record, a __u32
+ * length followed by the data, is stored and published whole. Sets need
+ * to the room it takes.
+ */
+static ssize_t scullpipe_produce_rec(struct scullpipe_dev *sdev, const char __user *from,
+		size_t count, size_t *need)
+{
+	u32 rp = smp_load_acquire(&sdev->ring->tail);
+	u32 wp = READ_ONCE(sdev->ring->head);
+	u32 len = count;
+
+	/* Zero length writes store no record */
+	if (!count)
+		return 0;
+
+	if (count > READ_ONCE(sdev->max_record) || count > sdev->size - SCULLP_REC_HDR)
+		return -EMSGSIZE;
+
+	*need = SCULLP_REC_HDR + count;
+
+	if (readavail(rp, wp) > sdev->size)
+		return -EIO;
+	if (spacefree(sdev, rp, wp) < *need)
+		return -EAGAIN;
+
+	ring_poke(sdev, wp, &len, sizeof(len));
+	if (ring_from_user(sdev, wp + SCULLP_REC_HDR, from, count))
 		return -EFAULT;
+
+	smp_store_release(&sdev->ring->head, wp + *need);
+
+	return count;
+}
+
+/*
+ * By default a write stores what fits and returns. With full_write set it
+ * behaves like a pipe: requests up to PIPE_BUF (or the buffer size) are
+ * written in one go or not at all, and blocking writers keep going until
+ * the whole request is in.
+ */
+static ssize_t __scullpipe_write(struct file *filp, const char __user *from, size_t count, loff_t *off)
+{
+	struct scullpipe_dev *sdev = filp->private_data;
+	bool full = READ_ONCE(sdev->full_write);
+	size_t need, done = 0;
+	bool packet;
+	ssize_t ret;
+
+	need = full && count && count <= scullmin(PIPE_BUF, READ_ONCE(sdev->size)) ? count : 1;
+
+	if (!count)
+		scullpipe_write_doorbell(sdev);
+
+	for (;;) {
+		if (down_interruptible(&sdev->wsem)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		packet = READ_ONCE(sdev->packet);
+		if (packet)
+			ret = scullpipe_produce_rec(sdev, from, count, &need);
+		else
+			ret = scullpipe_produce(sdev, from + done, count - done, need);
+		up(&sdev->wsem);
+
+		if (ret > 0) {
+			done += ret;
+			scullpipe_produced(sdev, ret);
+
+			if (packet || !full || done == count)
+				break;
+			continue;
+		}
+
+		if (ret != -EAGAIN)
+			break;
+
+		scullpipe_flush_readers(sdev);
+		if (filp->f_flags & O_NONBLOCK)
+			break;
+
+		if (wait_event_interruptible(sdev->wq, cbroom(sdev, need))) {
+			ret = -ERESTARTSYS;
+			break;
+		}
 	}
 
-	sdev->wp += count;
+	return done ? done : ret;
+}
 
-	if (sdev->wp == sdev->bb + SCULLP_BUF_SIZE)
-		sdev->wp = sdev->bb;
-	
+static bool scullpipe_size_valid(unsigned long size)
+{
+	return is_power_of_2(size) && size >= SCULLP_BUF_MIN && size <= SCULLP_BUF_MAX;
+}
+
+static bool scullpipe_max_record_valid(unsigned long max)
+{
+	return max && max <= SCULLP_BUF_MAX - SCULLP_REC_HDR;
+}
+
+/* Shuts both sides out of the ring. */
+static int scullpipe_quiesce(struct scullpipe_dev *sdev)
+{
+	if (mutex_lock_interruptible(&sdev->resize_lock))
+		return -ERESTARTSYS;
+
+	down(&sdev->rsem);
+	down(&sdev->wsem);
+
+	return 0;
+}
+
+static void scullpipe_resume(struct scullpipe_dev *sdev)
+{
 	up(&sdev->wsem);
+	up(&sdev->rsem);
+	mutex_unlock(&sdev->resize_lock);
 
 	wake_up_interruptible(&sdev->rq);
+	wake_up_interruptible(&sdev->wq);
+}
 
-	return count;
+/*
+ * Moves the data to a buffer of a new size. A mapped ring can't move,
+ * mappings are only made under resize_lock.
+ */
+static long scullpipe_resize(struct scullpipe_dev *sdev, unsigned long size)
+{
+	size_t used, off, first;
+	char *bb;
+	long ret = size;
+
+	if (!scullpipe_size_valid(size))
+		return -EINVAL;
+
+	bb = vmalloc_user(size);
+	if (!bb)
+		return -ENOMEM;
+
+	if (scullpipe_quiesce(sdev)) {
+		vfree(bb);
+		return -ERESTARTSYS;
+	}
+
+	if (atomic_read(&sdev->nr_maps)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	used = readavail(sdev->ring->tail, sdev->ring->head);
+	if (used > size) {
+		ret = used > sdev->size ? -EIO : -EBUSY;
+		goto out;
+	}
+
+	off = sdev->ring->tail & (sdev->size - 1);
+	first = scullmin(used, sdev->size - off);
+	memcpy(bb, sdev->bb + off, first);
+	memcpy(bb + first, sdev->bb, used - first);
+
+	swap(sdev->bb, bb);
+	sdev->size = size;
+	sdev->ring->size = size;
+	WRITE_ONCE(sdev->ring->tail, 0);
+	WRITE_ONCE(sdev->ring->head, used);
+
+out:
+	scullpipe_resume(sdev);
+	vfree(bb);
+
+	return ret;
 }
 
-static int scullpipe_init(void)
+/* Bytes and records can't share the ring, the mode only changes when empty. */
+static long scullpipe_set_packet(struct scullpipe_dev *sdev, bool packet)
 {
-	int ret;
-	dev_t dev;
+	long ret = 0;
 
-	printk(KERN_DEBUG "scullpipe init\n");
+	if (scullpipe_quiesce(sdev))
+		return -ERESTARTSYS;
 
-	if (scullpipe_major) {
-		dev = MKDEV(scullpipe_major, scullpipe_minor);
-		ret = register_chrdev_region(dev, 1, "scullpipe");
-	} else {
-		ret = alloc_chrdev_region(&dev, scullpipe_minor, 1, "scullpipe");
+	if (sdev->packet != packet && !cbempty(sdev))
+		ret = -EBUSY;
+	else
+		WRITE_ONCE(sdev->packet, packet);
+
+	scullpipe_resume(sdev);
+
+	return ret;
+}
+
+static long scullpipe_read_batch(struct file *filp, struct scullpipe_batch __user *ub)
+{
+	struct scullpipe_dev *sdev = filp->private_data;
+	struct scullpipe_batch b;
+	long ret;
+
+	if (copy_from_user(&b, ub, sizeof(b)))
+		return -EFAULT;
+
+	for (;;) {
+		if (down_interruptible(&sdev->rsem))
+			return -ERESTARTSYS;
+
+		if (READ_ONCE(sdev->packet))
+			ret = scullpipe_consume_batch(sdev, &b);
+		else
+			ret = -EINVAL;
+		up(&sdev->rsem);
+
+		if (ret != -EAGAIN || (filp->f_flags & O_NONBLOCK))
+			break;
+
+		if (wait_event_interruptible(sdev->rq, (!cbempty(sdev))))
+			return -ERESTARTSYS;
 	}
 
-	if (unlikely(ret)) {
-		printk(KERN_DEBUG "Failed to allocate char dev num\n");
-		return ret;
+	if (ret > 0) {
+		scullpipe_consumed(sdev, b.bytes);
+
+		if (put_user(b.nr, &ub->nr) || put_user(b.bytes, &ub->bytes))
+			return -EFAULT;
 	}
 
-	sdev = (struct scullpipe_dev*) kmalloc(sizeof(struct scullpipe_dev), GFP_KERNEL);
+	return ret;
+}
 
-	if (unlikely(!sdev)) {
-		printk(KERN_DEBUG "Failed to allocate memory\n");
-		return -ENOMEM;
+static long scullpipe_get_stats(struct scullpipe_dev *sdev, struct scullpipe_stats __user *us)
+{
+	struct scullpipe_stats st = {
+		.bytes_written = atomic64_read(&sdev->bytes_written),
+		.bytes_read = atomic64_read(&sdev->bytes_read),
+		.reader_wakeups = atomic64_read(&sdev->reader_wakeups),
+		.writer_wakeups = atomic64_read(&sdev->writer_wakeups),
+	};
+
+	return copy_to_user(us, &st, sizeof(st)) ? -EFAULT : 0;
+}
+
+static long scullpipe_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scullpipe_dev *sdev = filp->private_data;
+
+	if (_IOC_TYPE(cmd) != SCULLPIPE_IOC_MAGIC || _IOC_NR(cmd) > SCULLPIPE_IOC_MAXNR)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case SCULLPIPE_IOCSSIZE:
+		return scullpipe_resize(sdev, arg);
+	case SCULLPIPE_IOCGSIZE:
+		return READ_ONCE(sdev->size);
+	case SCULLPIPE_IOCSFULLWRITE:
+		WRITE_ONCE(sdev->full_write, arg != 0);
+		return 0;
+	case SCULLPIPE_IOCGFULLWRITE:
+		return READ_ONCE(sdev->full_write);
+	case SCULLPIPE_IOCSPACKET:
+		return scullpipe_set_packet(sdev, arg != 0);
+	case SCULLPIPE_IOCGPACKET:
+		return READ_ONCE(sdev->packet);
+	case SCULLPIPE_IOCSMAXREC:
+		if (!scullpipe_max_record_valid(arg))
+			return -EINVAL;
+		WRITE_ONCE(sdev->max_record, arg);
+		return 0;
+	case SCULLPIPE_IOCGMAXREC:
+		return READ_ONCE(sdev->max_record);
+	case SCULLPIPE_IOCSHIWAT:
+		if (!arg || arg > SCULLP_BUF_MAX)
+			return -EINVAL;
+		WRITE_ONCE(sdev->hiwat, arg);
+		scullpipe_flush_readers(sdev);
+		return 0;
+	case SCULLPIPE_IOCGHIWAT:
+		return READ_ONCE(sdev->hiwat);
+	case SCULLPIPE_IOCSLOWAT:
+		if (arg > SCULLP_BUF_MAX)
+			return -EINVAL;
+		WRITE_ONCE(sdev->lowat, arg);
+		return 0;
+	case SCULLPIPE_IOCGLOWAT:
+		return READ_ONCE(sdev->lowat);
+	case SCULLPIPE_IOCSMAXDELAY:
+		if (arg > UINT_MAX)
+			return -EINVAL;
+		WRITE_ONCE(sdev->max_delay, arg);
+		return 0;
+	case SCULLPIPE_IOCGMAXDELAY:
+		return READ_ONCE(sdev->max_delay);
+	case SCULLPIPE_IOCGSTATS:
+		return scullpipe_get_stats(sdev, (struct scullpipe_stats __user *)arg);
+	case SCULLPIPE_IOCREADBATCH:
+		return scullpipe_read_batch(filp, (struct scullpipe_batch __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Readable while there is data. Writable while there is space, or room
+ * for a whole atomic write in full_write mode or a PIPE_BUF record in
+ * packet mode, so that a non-blocking writer woken by poll doesn't get
+ * EAGAIN.
+ */
+static __poll_t scullpipe_poll(struct file *filp, poll_table *wait)
+{
+	struct scullpipe_dev *sdev = filp->private_data;
+	__poll_t mask = 0;
+	bool writable;
+	size_t need;
+
+	poll_wait(filp, &sdev->rq, wait);
+	poll_wait(filp, &sdev->wq, wait);
+
+	if (READ_ONCE(sdev->packet)) {
+		need = SCULLP_REC_HDR + scullmin(PIPE_BUF, READ_ONCE(sdev->max_record));
+		writable = cbroom(sdev, scullmin(need, READ_ONCE(sdev->size)));
+	} else if (READ_ONCE(sdev->full_write))
+		writable = cbroom(sdev, scullmin(PIPE_BUF, READ_ONCE(sdev->size)));
+	else
+		writable = !cbfull(sdev);
+
+	if (!cbempty(sdev))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (writable)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static int scullpipe_fasync(int fd, struct file *filp, int mode)
+{
+	struct scullpipe_dev *sdev = filp->private_data;
+
+	return fasync_helper(fd, filp, mode, &sdev->async_queue);
+}
+
+static void scullpipe_vma_open(struct vm_area_struct *vma)
+{
+	struct scullpipe_dev *sdev = vma->vm_private_data;
+
+	atomic_inc(&sdev->nr_maps);
+}
+
+static void scullpipe_vma_close(struct vm_area_struct *vma)
+{
+	struct scullpipe_dev *sdev = vma->vm_private_data;
+
+	atomic_dec(&sdev->nr_maps);
+}
+
+static const struct vm_operations_struct scullpipe_vm_ops = {
+	.open = scullpipe_vma_open,
+	.close = scullpipe_vma_close,
+};
+
+/*
+ * Maps the header page at offset 0 and bb right after it, see
+ * scullpipe.h for the protocol. The pages are inserted up front, the
+ * buffer can't be resized while it is mapped.
+ */
+static int scullpipe_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scullpipe_dev *sdev = filp->private_data;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long pgoff = vma->vm_pgoff, addr;
+	struct page *page;
+	int ret = 0;
+
+	if (mutex_lock_interruptible(&sdev->resize_lock))
+		return -ERESTARTSYS;
+
+	if (pgoff + (len >> PAGE_SHIFT) > 1 + (PAGE_ALIGN(sdev->size) >> PAGE_SHIFT)) {
+		ret = -EINVAL;
+		goto out;
 	}
 
-	sdev->bb = kmalloc(SCULLP_BUF_SIZE, GFP_KERNEL);
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
 
-	if (!sdev->bb) {
-		printk(KERN_DEBUG "Failed to allocate mem for int buf\n");
-		kfree(sdev);
+	for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE, pgoff++) {
+		if (pgoff)
+			page = vmalloc_to_page(sdev->bb + ((pgoff - 1) << PAGE_SHIFT));
+		else
+			page = virt_to_page(sdev->ring);
+
+		ret = vm_insert_page(vma, addr, page);
+		if (ret)
+			goto out;
+	}
+
+	vma->vm_ops = &scullpipe_vm_ops;
+	vma->vm_private_data = sdev;
+	atomic_inc(&sdev->nr_maps);
+
+out:
+	mutex_unlock(&sdev->resize_lock);
+	return ret;
+}
+
+/*
+ * The tracepoints cover the whole call, including the time spent waiting
+ * for data or space. The clock is only read while they are enabled.
+ */
+static ssize_t scullpipe_read(struct file *filp, char __user *to, size_t count, loff_t *off)
+{
+	u64 start = trace_scullpipe_read_enabled() ? ktime_get_ns() : 0;
+	ssize_t ret = __scullpipe_read(filp, to, count, off);
+
+	trace_scullpipe_read(iminor(file_inode(filp)), count, ret,
+			start ? ktime_get_ns() - start : 0);
+	return ret;
+}
+
+static ssize_t scullpipe_write(struct file *filp, const char __user *from, size_t count, loff_t *off)
+{
+	u64 start = trace_scullpipe_write_enabled() ? ktime_get_ns() : 0;
+	ssize_t ret = __scullpipe_write(filp, from, count, off);
+
+	trace_scullpipe_write(iminor(file_inode(filp)), count, ret,
+			start ? ktime_get_ns() - start : 0);
+	return ret;
+}
+
+static int scullpipe_setup_dev(struct scullpipe_dev *sdev)
+{
+	sdev->size = scullpipe_buf_size;
+	sdev->ring = (struct scullpipe_ring *)get_zeroed_page(GFP_KERNEL);
+	sdev->bb = vmalloc_user(sdev->size);
+	if (!sdev->ring || !sdev->bb) {
+		free_page((unsigned long)sdev->ring);
+		vfree(sdev->bb);
 		return -ENOMEM;
 	}
 
-	sdev->wp = sdev->bb;
-	sdev->rp = sdev->bb;
+	sdev->ring->size = sdev->size;
+	sdev->ring->data_offset = PAGE_SIZE;
+	atomic_set(&sdev->nr_maps, 0);
+	sdev->full_write = scullpipe_full_write;
+	sdev->packet = scullpipe_packet;
+	sdev->max_record = scullpipe_max_record;
+	sdev->hiwat = scullpipe_hiwat;
+	sdev->lowat = scullpipe_lowat;
+	sdev->max_delay = scullpipe_max_delay;
+	hrtimer_init(&sdev->delay_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sdev->delay_timer.function = scullpipe_delay_fn;
+	atomic64_set(&sdev->bytes_written, 0);
+	atomic64_set(&sdev->bytes_read, 0);
+	atomic64_set(&sdev->reader_wakeups, 0);
+	atomic64_set(&sdev->writer_wakeups, 0);
+	mutex_init(&sdev->resize_lock);
+
+	sema_init(&sdev->rsem, 1);
+	sema_init(&sdev->wsem, 1);
 
 	init_waitqueue_head(&sdev->wq);
 	init_waitqueue_head(&sdev->rq);
+	sdev->async_queue = NULL;
 
 	cdev_init(&sdev->cdev, &fops);
+	sdev->cdev.owner = THIS_MODULE;
+
+	return 0;
+}
+
+static void scullpipe_free_dev(struct scullpipe_dev *sdev)
+{
+	hrtimer_cancel(&sdev->delay_timer);
+	vfree(sdev->bb);
+	free_page((unsigned long)sdev->ring);
+}
+
+static void scullpipe_cleanup(int nr_added)
+{
+	int i;
+
+	for (i = 0; i < nr_added; i++) {
+		cdev_del(&scullpipe_devices[i].cdev);
+		scullpipe_free_dev(&scullpipe_devices[i]);
+	}
+
+	kfree(scullpipe_devices);
+	unregister_chrdev_region(MKDEV(scullpipe_major, scullpipe_minor), scullpipe_nr_devs);
+}
+
+static int scullpipe_init(void)
+{
+	int i, ret;
+	dev_t dev;
+
+	printk(KERN_DEBUG "scullpipe init\n");
+
+	if (!scullpipe_size_valid(scullpipe_buf_size)) {
+		printk(KERN_DEBUG "Invalid buffer size %u\n", scullpipe_buf_size);
+		return -EINVAL;
+	}
+
+	if (!scullpipe_max_record_valid(scullpipe_max_record)) {
+		printk(KERN_DEBUG "Invalid max record size %u\n", scullpipe_max_record);
+		return -EINVAL;
+	}
+
+	if (!scullpipe_hiwat || scullpipe_hiwat > SCULLP_BUF_MAX ||
+			scullpipe_lowat > SCULLP_BUF_MAX) {
+		printk(KERN_DEBUG "Invalid watermarks %u %u\n", scullpipe_hiwat, scullpipe_lowat);
+		return -EINVAL;
+	}
+
+	if (scullpipe_nr_devs < 1 || scullpipe_nr_devs > SCULLP_NR_DEVS_MAX) {
+		printk(KERN_DEBUG "Invalid number of devices %d\n", scullpipe_nr_devs);
+		return -EINVAL;
+	}
+
+	if (scullpipe_major) {
+		dev = MKDEV(scullpipe_major, scullpipe_minor);
+		ret = register_chrdev_region(dev, scullpipe_nr_devs, "scullpipe");
+	} else {
+		ret = alloc_chrdev_region(&dev, scullpipe_minor, scullpipe_nr_devs, "scullpipe");
+		scullpipe_major = MAJOR(dev);
+	}
 
-	ret = cdev_add(&sdev->cdev, dev, 1);
 	if (unlikely(ret)) {
-		printk(KERN_DEBUG "Failed to obtain char dev major\n");
-		kfree(sdev->bb);
-		kfree(sdev);
+		printk(KERN_DEBUG "Failed to allocate char dev num\n");
 		return ret;
 	}
 
+	scullpipe_devices = kcalloc(scullpipe_nr_devs, sizeof(struct scullpipe_dev), GFP_KERNEL);
+
+	if (unlikely(!scullpipe_devices)) {
+		printk(KERN_DEBUG "Failed to allocate memory\n");
+		unregister_chrdev_region(dev, scullpipe_nr_devs);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < scullpipe_nr_devs; i++) {
+		ret = scullpipe_setup_dev(&scullpipe_devices[i]);
+		if (unlikely(ret)) {
+			printk(KERN_DEBUG "Failed to allocate mem for int buf %d\n", i);
+			scullpipe_cleanup(i);
+			return ret;
+		}
+
+		ret = cdev_add(&scullpipe_devices[i].cdev,
+				MKDEV(scullpipe_major, scullpipe_minor + i), 1);
+		if (unlikely(ret)) {
+			printk(KERN_DEBUG "Failed to add cdev %d\n", i);
+			scullpipe_free_dev(&scullpipe_devices[i]);
+			scullpipe_cleanup(i);
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
 static void scullpipe_exit(void)
 {
 	printk(KERN_DEBUG "scullpipe exit\n");
-	kfree(sdev->bb);
-	kfree(sdev);
+	scullpipe_cleanup(scullpipe_nr_devs);
 }
 
 module_init(scullpipe_init);
@@ -0,0 +1,116 @@
+#ifndef _SCULLPIPE_H_
+#define _SCULLPIPE_H_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Header page of the ring, mapped at offset 0 of the device, the data
+ * follows at data_offset, one page in. head and tail are free running
+ * byte counts, the data is at (index & (size - 1)) and head - tail bytes
+ * are in use. They sit on cache lines of their own.
+ *
+ * A mapped producer copies its data in, then stores the new head with
+ * release semantics. A mapped consumer loads head with acquire semantics,
+ * copies the data out, then stores the new tail with release semantics.
+ * Each side must have a single producer or consumer at a time, whether it
+ * goes through the mapping or read() and write(). Writing the tail needs
+ * a shared writable mapping, so an O_RDWR open.
+ *
+ * Moving an index doesn't wake anybody: a zero length write() wakes the
+ * readers and a zero length read() wakes the writers. Either then blocks
+ * like any other call until there is respectively space or data, unless
+ * the file is non-blocking. poll() and SIGIO work as usual.
+ *
+ * In packet mode the ring holds records, each a __u32 length followed by
+ * the data, with no padding, either part possibly wrapping. A producer
+ * moves head past a whole record at once.
+ */
+struct scullpipe_ring
+{
+	__u32 head;
+	__u32 __pad1[15];
+	__u32 tail;
+	__u32 __pad2[15];
+	__u32 size;		/* of the data area, a power of two */
+	__u32 data_offset;	/* from the start of the mapping */
+};
+
+/*
+ * For SCULLPIPE_IOCREADBATCH: the data of the records is packed in data
+ * and the length of each one stored in index.
+ */
+struct scullpipe_batch
+{
+	__u64 data;		/* user pointer */
+	__u64 index;		/* user pointer to __u32 entries */
+	__u32 data_len;
+	__u32 index_len;	/* number of entries */
+	__u32 nr;		/* out: records read */
+	__u32 bytes;		/* out: bytes of data */
+};
+
+/*
+ * For SCULLPIPE_IOCGSTATS, wakeups count the times a side was woken, not
+ * the tasks. Their ratio to the bytes shows how well wakeups coalesce.
+ */
+struct scullpipe_stats
+{
+	__u64 bytes_written;
+	__u64 bytes_read;
+	__u64 reader_wakeups;
+	__u64 writer_wakeups;
+};
+
+/*
+ * Ioctl interface of the scullpipe device, shared with userspace.
+ *
+ * SCULLPIPE_IOCSSIZE resizes the buffer, like F_SETPIPE_SZ does for pipes.
+ * The size is passed by value and must be a power of two, data already in
+ * the buffer is kept and a size too small to hold it fails with EBUSY.
+ * Both return the size of the buffer.
+ *
+ * SCULLPIPE_IOCSFULLWRITE, passed 0 or 1 by value, makes writes behave
+ * like on a pipe: up to PIPE_BUF bytes are written atomically and
+ * blocking writes return once the whole request is written.
+ *
+ * The buffer can't be resized while it is mapped, SCULLPIPE_IOCSSIZE then
+ * fails with EBUSY.
+ *
+ * SCULLPIPE_IOCSPACKET, passed 0 or 1 by value, switches packet mode, and
+ * fails with EBUSY unless the buffer is empty. Each write() then stores
+ * one record atomically, or fails with EMSGSIZE past the size set with
+ * SCULLPIPE_IOCSMAXREC, and each read() returns one record, dropping what
+ * doesn't fit. SCULLPIPE_IOCREADBATCH reads as many whole records as fit
+ * in a struct scullpipe_batch and returns their number, it fails with
+ * EMSGSIZE when not even the first one fits.
+ *
+ * SCULLPIPE_IOCSHIWAT sets how many bytes must be buffered before readers
+ * are woken, SCULLPIPE_IOCSLOWAT how few before writers are, both capped
+ * by the buffer size. SCULLPIPE_IOCSMAXDELAY sets how many microseconds
+ * readers may go unwoken below the high watermark, 0 leaves them until a
+ * writer blocks or closes. The defaults wake on every byte.
+ */
+#define SCULLPIPE_IOC_MAGIC	'p'
+
+#define SCULLPIPE_IOCSSIZE	_IO(SCULLPIPE_IOC_MAGIC, 1)
+#define SCULLPIPE_IOCGSIZE	_IO(SCULLPIPE_IOC_MAGIC, 2)
+#define SCULLPIPE_IOCSFULLWRITE	_IO(SCULLPIPE_IOC_MAGIC, 3)
+#define SCULLPIPE_IOCGFULLWRITE	_IO(SCULLPIPE_IOC_MAGIC, 4)
+
+#define SCULLPIPE_IOCSPACKET	_IO(SCULLPIPE_IOC_MAGIC, 5)
+#define SCULLPIPE_IOCGPACKET	_IO(SCULLPIPE_IOC_MAGIC, 6)
+#define SCULLPIPE_IOCSMAXREC	_IO(SCULLPIPE_IOC_MAGIC, 7)
+#define SCULLPIPE_IOCGMAXREC	_IO(SCULLPIPE_IOC_MAGIC, 8)
+#define SCULLPIPE_IOCREADBATCH	_IOWR(SCULLPIPE_IOC_MAGIC, 9, struct scullpipe_batch)
+#define SCULLPIPE_IOCSHIWAT	_IO(SCULLPIPE_IOC_MAGIC, 10)
+#define SCULLPIPE_IOCGHIWAT	_IO(SCULLPIPE_IOC_MAGIC, 11)
+#define SCULLPIPE_IOCSLOWAT	_IO(SCULLPIPE_IOC_MAGIC, 12)
+#define SCULLPIPE_IOCGLOWAT	_IO(SCULLPIPE_IOC_MAGIC, 13)
+#define SCULLPIPE_IOCSMAXDELAY	_IO(SCULLPIPE_IOC_MAGIC, 14)
+#define SCULLPIPE_IOCGMAXDELAY	_IO(SCULLPIPE_IOC_MAGIC, 15)
+#define SCULLPIPE_IOCGSTATS	_IOR(SCULLPIPE_IOC_MAGIC, 16, struct scullpipe_stats)
+
+#define SCULLPIPE_IOC_MAXNR	16
+
+#endif /* _SCULLPIPE_H_ */
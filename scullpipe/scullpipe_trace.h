@@ -0,0 +1,78 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scullpipe
+
+#if !defined(_SCULLPIPE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULLPIPE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(scullpipe_file,
+
+	TP_PROTO(unsigned int minor, fmode_t mode),
+
+	TP_ARGS(minor, mode),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	minor)
+		__field(unsigned int,	mode)
+	),
+
+	TP_fast_assign(
+		__entry->minor	= minor;
+		__entry->mode	= (__force unsigned int) mode;
+	),
+
+	TP_printk("minor=%u mode=0x%x", __entry->minor, __entry->mode)
+);
+
+DEFINE_EVENT(scullpipe_file, scullpipe_open,
+	TP_PROTO(unsigned int minor, fmode_t mode),
+	TP_ARGS(minor, mode)
+);
+
+DEFINE_EVENT(scullpipe_file, scullpipe_release,
+	TP_PROTO(unsigned int minor, fmode_t mode),
+	TP_ARGS(minor, mode)
+);
+
+DECLARE_EVENT_CLASS(scullpipe_rw,
+
+	TP_PROTO(unsigned int minor, size_t count, ssize_t ret, u64 ns),
+
+	TP_ARGS(minor, count, ret, ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	minor)
+		__field(size_t,		count)
+		__field(ssize_t,	ret)
+		__field(u64,		ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor	= minor;
+		__entry->count	= count;
+		__entry->ret	= ret;
+		__entry->ns	= ns;
+	),
+
+	TP_printk("minor=%u count=%zu ret=%zd ns=%llu",
+		  __entry->minor, __entry->count, __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(scullpipe_rw, scullpipe_read,
+	TP_PROTO(unsigned int minor, size_t count, ssize_t ret, u64 ns),
+	TP_ARGS(minor, count, ret, ns)
+);
+
+DEFINE_EVENT(scullpipe_rw, scullpipe_write,
+	TP_PROTO(unsigned int minor, size_t count, ssize_t ret, u64 ns),
+	TP_ARGS(minor, count, ret, ns)
+);
+
+#endif /* _SCULLPIPE_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scullpipe_trace
+#include <trace/define_trace.h>